@@ -0,0 +1,65 @@
+#include "RooWorkspace.h"
+#include "RooAbsPdf.h"
+#include "RooDataSet.h"
+#include "RooFitResult.h"
+#include "RooRealVar.h"
+#include "RooMinimizer.h"
+#include "TFile.h"
+#include "TStopwatch.h"
+
+#include "RooStats/ModelConfig.h"
+
+#include "../common/CompactData.h"
+
+using namespace RooFit;
+
+// Fit of the model of HiggsModel.cpp (run it first) with the event data in compact storage:
+//   - fitTo on the RooDataSet, as reference
+//   - CompactNLL with x in single precision (kFloat32)
+//   - CompactNLL with x as bin indices in the 50 bins of the workspace, the events of a bin
+//     merged into one weighted entry (kBinIndex)
+// Every fit starts from the same parameter values; the macro prints the fit times, the memory
+// used by the event data and the fitted parameters.
+void CompactFit( const char* filename = "HiggsModel.root",
+                 const char* workspaceName = "w",
+                 const char* modelConfigName = "ModelConfig",
+                 const char* dataName = "data" )
+{
+   TFile *file = TFile::Open(filename);
+   if (!file) {
+      cout << "Input file " << filename << " is not found - run HiggsModel.cpp first" << endl;
+      return;
+   }
+   RooWorkspace * w = (RooWorkspace*) file->Get(workspaceName);
+   RooStats::ModelConfig* mc = (RooStats::ModelConfig*) w->obj(modelConfigName);
+   RooAbsData * data = w->data(dataName);
+   RooAbsPdf * pdf = mc->GetPdf();
+
+   std::unique_ptr<RooArgSet> params(pdf->getParameters(*data));
+   std::unique_ptr<RooArgSet> start(static_cast<RooArgSet*>(params->snapshot()));
+
+   TStopwatch timer;
+   RooFitResult * ref = pdf->fitTo(*data, Save(true), Minimizer("Minuit2","Migrad"), PrintLevel(-1));
+   const double fitToTime = timer.RealTime();
+   cout << "fitTo (RooDataSet): " << fitToTime << " s, "
+        << data->numEntries() * 8 << " bytes of event data" << endl;
+   ref->Print();
+
+   const CompactDataSet::Storage storages[] = {CompactDataSet::kFloat32, CompactDataSet::kBinIndex};
+   const char* names[] = {"kFloat32", "kBinIndex"};
+   for (int k = 0; k < 2; ++k) {
+      params->assign(*start);
+      timer.Start();
+      std::shared_ptr<CompactDataSet> compact = std::make_shared<CompactDataSet>(*data, *mc->GetObservables(), storages[k]);
+      CompactNLL nll(TString::Format("nll_%s", names[k]), *pdf, compact);
+      RooMinimizer minim(nll);
+      minim.setMinimizerType("Minuit2");
+      minim.setPrintLevel(-1);
+      minim.migrad();
+      minim.hesse();
+      RooFitResult * r = minim.save();
+      cout << "CompactNLL (" << names[k] << ", " << compact->NEntries() << " entries): " << timer.RealTime()
+           << " s, " << compact->Bytes() << " bytes of event data" << endl;
+      r->Print();
+   }
+}
@@ -1,10 +1,16 @@
+#include "../common/PipelinedToyMCSampler.h"
+#include "../common/ResultWriter.h"
+#include "../common/ProfileScan.h"
+
 using namespace RooStats;
 using namespace RooFit;
 
 void HypothesisTest( const char* filename =  "HiggsModel.root", 
                      const char* workspaceName = "w",
                      const char* modelConfigName = "ModelConfig",
-                     const char* dataName = "data" )
+                     const char* dataName = "data",
+                     const char* resultsFile = "HypothesisTest_results.root",
+                     const char* jobId = "" )
 {
     /////////////////////////////////////////////////////////////
     // First part is just to access the workspace file 
@@ -14,6 +20,10 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     TFile *file = TFile::Open(filename);
     if (!file) return;
 
+    // all numerical results are also written as TTrees, to be aggregated over many jobs; every row
+    // is tagged with jobId, or with the name of the results file if no jobId is given
+    ResultWriter writer(resultsFile, jobId);
+
     // get the workspace out of the file
     RooWorkspace* w = (RooWorkspace*) file->Get(workspaceName);
 
@@ -44,6 +54,7 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     // Run the calculator
     HypoTestResult * asResult = ac.GetHypoTest();
     asResult->Print();
+    writer.WriteHypoTest("asymptotic", *asResult);
 
     // HypoTestInverter
     HypoTestInverter acinverter(ac);
@@ -69,6 +80,8 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     std::cout << " expected limit (+1 sig) " << acinvresult->GetExpectedUpperLimit(1) << std::endl;
     std::cout << " expected limit (-2 sig) " << acinvresult->GetExpectedUpperLimit(-2) << std::endl;
     std::cout << " expected limit (+2 sig) " << acinvresult->GetExpectedUpperLimit(2) << std::endl;
+    writer.WriteScan("asymptotic", *acinvresult);
+    writer.WriteLimits("asymptotic", *acinvresult);
 
     // Create a CL plot
     TCanvas* acinvcan = new TCanvas();
@@ -82,17 +95,17 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     
     // Create the FrequentistCalculator from data,alt model, null model (frequentist hypothesis test calculators usingtoy data (difference in treatment of nuisanceparameters))
 
-    FrequentistCalculator   fc(*data, *sbModel, *bModel);
-    fc.SetToys(500,500);    // 2000 for null (B) and 500 for alt (S+B)
-
     // Create the test statistics
     ProfileLikelihoodTestStat profll(*sbModel->GetPdf());
-    // Use one-sided profile likelihood
-    profll.SetOneSidedDiscovery(true);
 
-    // Configure  ToyMCSampler and set the test statistics
-    ToyMCSampler *toymcs = (ToyMCSampler*)fc.GetTestStatSampler();
-    toymcs->SetTestStatistic(&profll);
+    // Configure the ToyMCSampler: toys are generated while the previous ones are fitted, and the
+    // conditional and unconditional fits of each toy run in parallel (0 = one worker per core)
+    PipelinedToyMCSampler *toymcs = new PipelinedToyMCSampler(profll, 500, *w, 0);
+    // Use one-sided profile likelihood (set through the sampler, which also configures profll)
+    toymcs->SetOneSidedDiscovery(true);
+
+    FrequentistCalculator   fc(*data, *sbModel, *bModel, toymcs);
+    fc.SetToys(500,500);    // 2000 for null (B) and 500 for alt (S+B)
     
     if (!sbModel->GetPdf()->canBeExtended())
       toymcs->SetNEventsPerToy(1);
@@ -100,6 +113,9 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     // Run the test
     HypoTestResult * fqResult = fc.GetHypoTest();
     fqResult->Print();
+    writer.WriteHypoTest("frequentist", *fqResult);
+    writer.WriteToys("frequentist", toymcs->NToysRun(), toymcs->NToysSkipped());
+    toymcs->ResetToyCounts();
 
     // Plot test statistic distributions
     TCanvas *can = new TCanvas();
@@ -109,6 +125,12 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     can->Draw();  
     can->SaveAs("test_statistic_distributions.png");
 
+    // Sample the S+B toys of every point of the scan in batches of 50 until CLs+b is known to 10%
+    // or CLs is 3 sigma away from 1-CL; the 500 toys of SetToys are the maximum per point.
+    // The B toys are always all generated, so the expected limits and the bands below, which are
+    // quantiles of their distribution, still use 500 toys per point
+    toymcs->SetSequentialSampling(*data, 1-0.683, 50, 50, 0.1, 3);
+
     // HypoTestInverter
     HypoTestInverter fcinverter(fc);
 
@@ -133,6 +155,9 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     std::cout << " expected limit (+1 sig) " << fcinvresult->GetExpectedUpperLimit(1) << std::endl;
     std::cout << " expected limit (-2 sig) " << fcinvresult->GetExpectedUpperLimit(-2) << std::endl;
     std::cout << " expected limit (+2 sig) " << fcinvresult->GetExpectedUpperLimit(2) << std::endl;
+    writer.WriteScan("frequentist", *fcinvresult);
+    writer.WriteLimits("frequentist", *fcinvresult);
+    writer.WriteToys("frequentist_scan", toymcs->NToysRun(), toymcs->NToysSkipped());
 
     // Create a CL plot
 
@@ -151,14 +176,21 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
 
     plc.SetConfidenceLevel(0.683);  //68% interval it is equivalent to plc.SetTestSize(0.32);
     //plc.SetConfidenceLevel(0.95); // 95% interval
-    LikelihoodInterval * plcinterval = plc.GetInterval();
 
-    const double MLE = poi->getVal();
-    const double lowerLimit = plcinterval->LowerLimit(*poi);
-    poi->setVal(MLE);
-    const double upperLimit = plcinterval->UpperLimit(*poi);
-    poi->setVal(MLE);
+    // The interval and the plot of the profile likelihood share one scan of the profiled NLL over
+    // the plotted range: the points are fitted in parallel and refined only near the interval edges
+    ProfileScan plcscan(*w, *bModel, *data);
+    ProfileScanResult plcscanResult = plcscan.Run(0, 100, 40, plc.ConfidenceLevel());
+
+    const double MLE = plcscanResult.mle;
+    const double lowerLimit = plcscanResult.lower;
+    const double upperLimit = plcscanResult.upper;
     std::cout << "68% CL interval: [ " << lowerLimit << " ; " << upperLimit << " ]\n" << std::endl;
+    writer.WriteInterval("profile_likelihood", plc.ConfidenceLevel(), MLE, lowerLimit, upperLimit);
+    // status of the unconditional fit of the scan; the curve points carry the status of their own fit
+    writer.WriteFit("profile_likelihood", plcscanResult.fitStatus, plcscanResult.nllMin);
+    for (size_t i = 0; i < plcscanResult.poi.size(); ++i)
+      writer.WriteCurvePoint("profile_likelihood", plcscanResult.poi[i], plcscanResult.deltaNLL[i], plcscanResult.status[i]);
 
     // //One-sided upper-limit
     // LikelihoodInterval * plcinterval = plc.GetInterval();
@@ -167,12 +199,20 @@ void HypothesisTest( const char* filename =  "HiggsModel.root",
     // std::cout << "One sided upper limit at 95% CL: "<< upperLimit << std::endl;
 
     TCanvas *plccan = new TCanvas();
-    LikelihoodIntervalPlot plcplot(plcinterval);
-    plcplot.SetRange(0,100);
-    plcplot.Draw();
+    TGraph* plccurve = plcscanResult.Curve();
+    plccurve->SetLineColor(kBlue);
+    plccurve->SetLineWidth(2);
+    plccurve->Draw("AL");
+    TLine* plcline = new TLine(plccurve->GetXaxis()->GetXmin(), plcscanResult.threshold,
+                               plccurve->GetXaxis()->GetXmax(), plcscanResult.threshold);
+    plcline->SetLineColor(kRed);
+    plcline->Draw();
     plccan->Draw();
     plccan->SaveAs("Negative_logarithm_of_the_profile _likelihood.png");
 
 
     plcResult->Print();
+    writer.WriteHypoTest("profile_likelihood", *plcResult);
+    writer.Close();
+    std::cout << "results written to file " << resultsFile << std::endl;
 }
@@ -0,0 +1,111 @@
+#include "../common/IncrementalState.h"
+
+using namespace RooStats;
+using namespace RooFit;
+
+// Update of the discovery significance when new data arrive. The model is read from the
+// workspace file as in HypothesisTest.cpp, but the data are the per-bin counts kept in
+// stateFile by the previous runs plus only the new events, and the fits start from the
+// previous best fit.
+// The first run takes the dataset of the workspace and must be started without newDataFile and
+// nToyEvents; it saves the state. The next runs read the new events from newDataFile, which is
+// required. To test the update without real data, give nToyEvents > 0
+// instead: that many toy events are generated and the state is not saved, so they never end up
+// in the accumulated counts.
+void IncrementalHypothesisTest( const char* newDataFile = "",
+                                int nToyEvents = 0,
+                                const char* stateFile = "IncrementalState.root",
+                                const char* filename = "HiggsModel.root",
+                                const char* workspaceName = "w",
+                                const char* modelConfigName = "ModelConfig",
+                                const char* dataName = "data" )
+{
+    // open input file
+    TFile *file = TFile::Open(filename);
+    if (!file) return;
+
+    // get the workspace out of the file
+    RooWorkspace* w = (RooWorkspace*) file->Get(workspaceName);
+
+    // Get the ModelConfig out of the file
+    ModelConfig*  sbModel = (RooStats::ModelConfig*) w->obj(modelConfigName);
+    RooRealVar* x = (RooRealVar*) sbModel->GetObservables()->first();
+    RooRealVar* poi = (RooRealVar*) sbModel->GetParametersOfInterest()->first();
+
+    // Counts and best fit of the previous runs
+    IncrementalState state(stateFile);
+
+    // the first run has nothing to update: it always starts from the dataset of the workspace
+    if (!state.HasHistory() && (nToyEvents > 0 || strlen(newDataFile) > 0)) {
+      std::cout << stateFile << " has no previous runs: run once without arguments to start from the dataset \""
+                << dataName << "\" of " << filename << ", then give the new data file or the toy events" << std::endl;
+      return;
+    }
+
+    const bool toyTest = nToyEvents > 0;
+    if (toyTest && strlen(newDataFile) > 0) {
+      std::cout << "give either a new data file or a number of toy events, not both" << std::endl;
+      return;
+    }
+
+    RooAbsData* newData = 0;
+    if (!state.HasHistory()) {
+      newData = w->data(dataName);
+    }
+    else if (toyTest) {
+      std::cout << "test run with " << nToyEvents << " toy events, the state will not be saved" << std::endl;
+      newData = sbModel->GetPdf()->generate(*x, nToyEvents);
+    }
+    else if (strlen(newDataFile) > 0) {
+      TFile *newFile = TFile::Open(newDataFile);
+      if (!newFile) return;
+      newData = (RooAbsData*) newFile->Get(dataName);
+    }
+    else {
+      std::cout << "no new data file given: " << stateFile << " already contains " << state.NEvents()
+                << " events from " << state.NRuns() << " runs" << std::endl;
+      return;
+    }
+    if (!newData) return;
+
+    state.Append(*newData, *x);
+    std::cout << "run " << state.NRuns() << ": " << newData->numEntries() << " new events, "
+              << state.NEvents() << " events in total" << std::endl;
+
+    RooDataHist* data = state.BinnedData(*x, "accumulated_data");
+
+    // Fit starting from the previous best fit
+    std::unique_ptr<RooArgSet> params(sbModel->GetPdf()->getParameters(RooArgSet(*x)));
+    state.WarmStart(*params);
+    RooFitResult* fitResult = sbModel->GetPdf()->fitTo(*data, Save(true), Minimizer("Minuit2","Migrad"), PrintLevel(-1));
+    fitResult->Print();
+    state.SetMLE(*params);
+
+    //-------------------------------------------------------------
+
+    sbModel->SetName("S+B Model");
+    poi->setVal(50);  // set POI snapshot in S+B model for expected significance
+    sbModel->SetSnapshot(*poi);
+
+    // Create the Background only model form the S+B model
+    ModelConfig * bModel = (ModelConfig*) sbModel->Clone();
+    bModel->SetName("B Model");
+    poi->setVal(0);
+    bModel->SetSnapshot( *poi  );
+
+    // The fits of the calculator start from the current values: go back to the best fit
+    state.WarmStart(*params);
+
+    // Create the AsymptoticCalculator from data,alt model, null model on the accumulated binned data
+    AsymptoticCalculator  ac(*data, *sbModel, *bModel);
+    ac.SetOneSidedDiscovery(true);  // for one-side discovery test
+
+    // Run the calculator
+    HypoTestResult * asResult = ac.GetHypoTest();
+    asResult->Print();
+
+    // Keep the counts and the best fit for the next run, unless the new events were toys
+    if (toyTest) return;
+    state.Save();
+    std::cout << "state written to file " << stateFile << std::endl;
+}
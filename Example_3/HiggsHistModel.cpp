@@ -8,10 +8,37 @@
 
 #include "RooStats/ModelConfig.h"
 
+#include "../common/SystMorphing.h"
+
 using namespace RooFit; 
 
 
-void HiggsHistModel()
+// Up/down template for a shape systematic: the nominal template reweighted bin by bin with the
+// ratio of the expected (fluctuation free) shapes at the shifted and at the nominal parameter value
+RooDataHist* MakeVariation(RooAbsPdf& pdf, RooRealVar& x, RooRealVar& par, double shifted, const RooDataHist& nominal)
+{
+   const double nomVal = par.getVal();
+   RooDataHist* expNom = pdf.generateBinned(x, nominal.sumEntries(), RooFit::ExpectedData());
+   par.setVal(shifted);
+   RooDataHist* expVar = pdf.generateBinned(x, nominal.sumEntries(), RooFit::ExpectedData());
+   par.setVal(nomVal);
+
+   RooDataHist* variation = new RooDataHist(TString(nominal.GetName()) + "_" + par.GetName(), "", RooArgSet(x));
+   for (int i = 0; i < nominal.numEntries(); ++i) {
+      const RooArgSet* bin = nominal.get(i);
+      const double wnom = nominal.weight();
+      expNom->get(i);
+      expVar->get(i);
+      const double ratio = expNom->weight() > 0 ? expVar->weight() / expNom->weight() : 1;
+      variation->add(*bin, wnom * ratio);
+   }
+   delete expNom;
+   delete expVar;
+   return variation;
+}
+
+
+void HiggsHistModel(bool addShapeSysts = false)
 { 
    RooWorkspace wsim("wsim"); 
    wsim.factory("Exponential:bkg_pdf(x[40,400], a[-0.01,-10,0])");
@@ -33,14 +60,52 @@ void HiggsHistModel()
    w.import(*hist_bkg,RooFit::Rename("template_bkg")) ;
    w.import(*hist_data,RooFit::Rename("observed_data")) ;
 
-   w.factory("HistFunc::sig(x,template_sig)") ;
-   w.factory("HistFunc::bkg(x,template_bkg)") ;
+   if (!addShapeSysts) {
+      w.factory("HistFunc::sig(x,template_sig)") ;
+      w.factory("HistFunc::bkg(x,template_bkg)") ;
+   }
+   else {
+      //Shape systematics: signal mass scale and width, background slope. The morphing coefficients
+      //are precomputed here once, so every NLL call only evaluates them (see common/SystMorphing.h)
+      RooRealVar* xsim = wsim.var("x");
+      RooDataHist* sig_mass_up   = MakeVariation(*wsim.pdf("sig_pdf"), *xsim, *wsim.var("mass"), 126, *hist_sig);
+      RooDataHist* sig_mass_down = MakeVariation(*wsim.pdf("sig_pdf"), *xsim, *wsim.var("mass"), 124, *hist_sig);
+      RooDataHist* sig_width_up   = MakeVariation(*wsim.pdf("sig_pdf"), *xsim, *wsim.var("sigma"), 5.5, *hist_sig);
+      RooDataHist* sig_width_down = MakeVariation(*wsim.pdf("sig_pdf"), *xsim, *wsim.var("sigma"), 4.5, *hist_sig);
+      RooDataHist* bkg_slope_up   = MakeVariation(*wsim.pdf("bkg_pdf"), *xsim, *wsim.var("a"), -0.009, *hist_bkg);
+      RooDataHist* bkg_slope_down = MakeVariation(*wsim.pdf("bkg_pdf"), *xsim, *wsim.var("a"), -0.011, *hist_bkg);
+
+      //Nuisance parameters with unit Gaussian constraints (the nominal values are the global observables)
+      w.factory("Gaussian::alpha_mass_constr(nom_alpha_mass[0,-5,5],alpha_mass[0,-5,5],1)") ;
+      w.factory("Gaussian::alpha_width_constr(nom_alpha_width[0,-5,5],alpha_width[0,-5,5],1)") ;
+      w.factory("Gaussian::alpha_slope_constr(nom_alpha_slope[0,-5,5],alpha_slope[0,-5,5],1)") ;
+      w.var("nom_alpha_mass")->setConstant(true);
+      w.var("nom_alpha_width")->setConstant(true);
+      w.var("nom_alpha_slope")->setConstant(true);
+
+      MorphedTemplate sig_morphed("sig_morphed", "sig_morphed", *w.data("template_sig"));
+      sig_morphed.AddShapeSys(*w.var("alpha_mass"), *sig_mass_up, *sig_mass_down, HistMorphing::kExponential);
+      sig_morphed.AddShapeSys(*w.var("alpha_width"), *sig_width_up, *sig_width_down, HistMorphing::kExponential);
+      MorphedTemplate bkg_morphed("bkg_morphed", "bkg_morphed", *w.data("template_bkg"));
+      bkg_morphed.AddShapeSys(*w.var("alpha_slope"), *bkg_slope_up, *bkg_slope_down, HistMorphing::kPolynomial);
+      MorphedHistFunc sig("sig", "sig", *w.var("x"), sig_morphed);
+      MorphedHistFunc bkg("bkg", "bkg", *w.var("x"), bkg_morphed);
+
+      w.import(sig, RooFit::RecycleConflictNodes()) ;
+      w.import(bkg, RooFit::RecycleConflictNodes()) ;
+   }
 
    w.factory("binw[0.277]") ; // bin width == 1/(400-30)
    w.factory("L[1]") ; // L is the luminosity ratio data to simulation. E.g. if L(simul) = 3x L(data), L=0.33 (so that all prediction are scaled down to what is expected for the data)
    w.factory("expr::S('mu*L*binw',mu[1,-1,6],L,binw[0.277])") ;
    w.factory("expr::B('Bscale*L*binw',Bscale[0,6],L,binw)") ;
-   w.factory("ASUM::model(S*sig,B*bkg)") ;
+   if (!addShapeSysts) {
+      w.factory("ASUM::model(S*sig,B*bkg)") ;
+   }
+   else {
+      w.factory("ASUM::model_shape(S*sig,B*bkg)") ;
+      w.factory("PROD::model(model_shape,alpha_mass_constr,alpha_width_constr,alpha_slope_constr)") ;
+   }
 
    w.pdf("model")->fitTo(*hist_data) ;
 
@@ -71,7 +136,13 @@ void HiggsHistModel()
    mc.SetPdf(*w.pdf("model"));
    mc.SetParametersOfInterest(*w.var("mu"));
    mc.SetObservables(*w.var("x"));
-   mc.SetNuisanceParameters(*w.var("Bscale"));
+   if (!addShapeSysts) {
+      mc.SetNuisanceParameters(*w.var("Bscale"));
+   }
+   else {
+      mc.SetNuisanceParameters(RooArgSet(*w.var("Bscale"), *w.var("alpha_mass"), *w.var("alpha_width"), *w.var("alpha_slope")));
+      mc.SetGlobalObservables(RooArgSet(*w.var("nom_alpha_mass"), *w.var("nom_alpha_width"), *w.var("nom_alpha_slope")));
+   }
    // // define set of nuisance parameters
    // w.defineSet("nuisParams","a,nbkg");
    // mc.SetNuisanceParameters(*w.set("nuisParams"));
@@ -1,10 +1,17 @@
+#include "../common/SystMorphing.h"  // class definition needed to read workspaces with shape systematics
+#include "../common/ResultWriter.h"
+#include "../common/ProfileScan.h"
+#include "../common/ContourScan.h"
+
 using namespace RooStats;
 using namespace RooFit;
 
 void HypothesisTest( const char* filename =  "HiggsHistModel.root", 
                      const char* workspaceName = "w",
                      const char* modelConfigName = "ModelConfig",
-                     const char* dataName = "observed_data" )
+                     const char* dataName = "observed_data",
+                     const char* resultsFile = "HypothesisTest_results.root",
+                     const char* jobId = "" )
 {
     /////////////////////////////////////////////////////////////
     // First part is just to access the workspace file 
@@ -14,6 +21,10 @@ void HypothesisTest( const char* filename =  "HiggsHistModel.root",
     TFile *file = TFile::Open(filename);
     if (!file) return;
 
+    // all numerical results are also written as TTrees, to be aggregated over many jobs; every row
+    // is tagged with jobId, or with the name of the results file if no jobId is given
+    ResultWriter writer(resultsFile, jobId);
+
     // get the workspace out of the file
     RooWorkspace* w = (RooWorkspace*) file->Get(workspaceName);
 
@@ -44,6 +55,7 @@ void HypothesisTest( const char* filename =  "HiggsHistModel.root",
     // Run the calculator
     HypoTestResult * asResult = ac.GetHypoTest();
     asResult->Print();
+    writer.WriteHypoTest("asymptotic", *asResult);
 
     // HypoTestInverter
     HypoTestInverter acinverter(ac);
@@ -69,6 +81,8 @@ void HypothesisTest( const char* filename =  "HiggsHistModel.root",
     std::cout << " expected limit (+1 sig) " << acinvresult->GetExpectedUpperLimit(1) << std::endl;
     std::cout << " expected limit (-2 sig) " << acinvresult->GetExpectedUpperLimit(-2) << std::endl;
     std::cout << " expected limit (+2 sig) " << acinvresult->GetExpectedUpperLimit(2) << std::endl;
+    writer.WriteScan("asymptotic", *acinvresult);
+    writer.WriteLimits("asymptotic", *acinvresult);
 
     // Create a CL plot
     TCanvas* acinvcan = new TCanvas();
@@ -152,14 +166,21 @@ void HypothesisTest( const char* filename =  "HiggsHistModel.root",
     // plc.SetConfidenceLevel(0.683);  //68% interval it is equivalent to plc.SetTestSize(0.32);
     plc.SetTestSize(0.90);
     //plc.SetConfidenceLevel(0.95); // 95% interval
-    LikelihoodInterval * plcinterval = plc.GetInterval();
 
-    const double MLE = poi->getVal();
-    const double lowerLimit = plcinterval->LowerLimit(*poi);
-    poi->setVal(MLE);
-    const double upperLimit = plcinterval->UpperLimit(*poi);
-    poi->setVal(MLE);
+    // The interval and the plot of the profile likelihood share one scan of the profiled NLL over
+    // the plotted range: the points are fitted in parallel and refined only near the interval edges
+    ProfileScan plcscan(*w, *bModel, *data);
+    ProfileScanResult plcscanResult = plcscan.Run(1.3, 1.8, 40, plc.ConfidenceLevel());
+
+    const double MLE = plcscanResult.mle;
+    const double lowerLimit = plcscanResult.lower;
+    const double upperLimit = plcscanResult.upper;
     std::cout << "68% CL interval: [ " << lowerLimit << " ; " << upperLimit << " ]\n" << std::endl;
+    writer.WriteInterval("profile_likelihood", plc.ConfidenceLevel(), MLE, lowerLimit, upperLimit);
+    // status of the unconditional fit of the scan; the curve points carry the status of their own fit
+    writer.WriteFit("profile_likelihood", plcscanResult.fitStatus, plcscanResult.nllMin);
+    for (size_t i = 0; i < plcscanResult.poi.size(); ++i)
+      writer.WriteCurvePoint("profile_likelihood", plcscanResult.poi[i], plcscanResult.deltaNLL[i], plcscanResult.status[i]);
 
     // //One-sided upper-limit
     // LikelihoodInterval * plcinterval = plc.GetInterval();
@@ -168,12 +189,48 @@ void HypothesisTest( const char* filename =  "HiggsHistModel.root",
     // std::cout << "One sided upper limit at 95% CL: "<< upperLimit << std::endl;
 
     TCanvas *plccan = new TCanvas();
-    LikelihoodIntervalPlot plcplot(plcinterval);
-    plcplot.SetRange(1.3,1.8);
-    plcplot.Draw();
+    TGraph* plccurve = plcscanResult.Curve();
+    plccurve->SetLineColor(kBlue);
+    plccurve->SetLineWidth(2);
+    plccurve->Draw("AL");
+    TLine* plcline = new TLine(plccurve->GetXaxis()->GetXmin(), plcscanResult.threshold,
+                               plccurve->GetXaxis()->GetXmax(), plcscanResult.threshold);
+    plcline->SetLineColor(kRed);
+    plcline->Draw();
     plccan->Draw();
     plccan->SaveAs("Negative_logarithm_of_the_profile _likelihood.png");
 
 
     plcResult->Print();
+    writer.WriteHypoTest("profile_likelihood", *plcResult);
+
+    //-------------------------------------------------------------
+    std::cout << "\n\nRun now 2D profile likelihood scan of mu and Bscale.....\n" << std::endl;
+
+    // 68% and 95% CL contours: a coarse grid fitted in parallel, refined only in the cells
+    // crossed by one of the contours
+    ContourScan contourscan(*w, *bModel, *data, poi->GetName(), "Bscale");
+    ContourScanResult contourResult = contourscan.Run(11, 11, {0.683, 0.95});
+    std::cout << contourResult.x.size() << " points fitted, best fit at " << poi->GetName() << " = "
+              << contourResult.xhat << ", Bscale = " << contourResult.yhat << std::endl;
+    writer.WriteFit("contour", contourResult.fitStatus, contourResult.nllMin);
+
+    TCanvas *contourcan = new TCanvas();
+    TGraph2D* surface = contourResult.Surface();
+    surface->Draw("colz");
+    const int contourColors[] = {kBlue, kRed};
+    for (size_t i = 0; i < contourResult.thresholds.size(); ++i) {
+      TList* contours = surface->GetContourList(contourResult.thresholds[i]);
+      if (!contours) continue;
+      for (TObject* obj : *contours) {
+        TGraph* contour = (TGraph*) obj;
+        contour->SetLineColor(contourColors[i % 2]);
+        contour->SetLineWidth(2);
+        contour->Draw("L same");
+      }
+    }
+    contourcan->Draw();
+    contourcan->SaveAs("Contour_mu_Bscale.png");
+    writer.Close();
+    std::cout << "results written to file " << resultsFile << std::endl;
 }
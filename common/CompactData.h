@@ -0,0 +1,253 @@
+#ifndef HYPOTHESIS_TEST_COMPACT_DATA_H
+#define HYPOTHESIS_TEST_COMPACT_DATA_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "RVersion.h"
+#include "TError.h"
+#include "Math/Util.h"
+#include "RooAbsBinning.h"
+#include "RooAbsData.h"
+#include "RooAbsPdf.h"
+#include "RooAbsReal.h"
+#include "RooArgSet.h"
+#include "RooListProxy.h"
+#include "RooRealVar.h"
+
+// The batch interface of RooAbsReal (getValues with a RunContext) exists in ROOT 6.24 to 6.26 only
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 24, 0) && ROOT_VERSION_CODE < ROOT_VERSION(6, 28, 0)
+#define COMPACT_NLL_RUN_CONTEXT
+#include "RooSpan.h"
+#include "RunContext.h"
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Compact storage of unbinned event data for the NLL hot loop. RooDataSet
+// keeps every observable and weight as a double; here each observable is a
+// column of
+//   - kFloat32  : single precision values (half the memory traffic), or
+//   - kBinIndex : 16 bit indices in the binning of the observable. Events in
+//                 the same bin are merged into one entry weighted by their
+//                 count and evaluated at the bin centre (a binned
+//                 approximation of the data), so the NLL loop runs over the
+//                 occupied bins instead of the events
+// With kFloat32 the weights, when the data are weighted, are single precision
+// too; with kBinIndex the summed weight of every entry is kept as a double.
+// CompactNLL sums the NLL over such a dataset in double precision with
+// Kahan summation, so the reduced storage does not reduce the precision of
+// the sum over many events.
+// kBinIndex throws std::invalid_argument for an observable with more bins
+// than a 16 bit index can hold.
+//////////////////////////////////////////////////////////////////////////////
+
+class CompactDataSet {
+public:
+   enum Storage { kFloat32, kBinIndex };
+
+   CompactDataSet(const RooAbsData& data, const RooArgSet& observables, Storage storage = kFloat32)
+      : fStorage(storage), fNEvents(data.numEntries())
+   {
+      std::vector<const RooAbsBinning*> binnings;
+      for (RooAbsArg* arg : observables) {
+         RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+         if (!var) continue;
+         fNames.push_back(var->GetName());
+         if (storage == kBinIndex) {
+            const RooAbsBinning& binning = var->getBinning();
+            if (binning.numBins() > std::numeric_limits<uint16_t>::max()) {
+               ::Error("CompactDataSet", "%s has more bins than a 16 bit index can hold", var->GetName());
+               throw std::invalid_argument(std::string("CompactDataSet: ") + var->GetName() + " has " +
+                                           std::to_string(binning.numBins()) + " bins, kBinIndex holds at most " +
+                                           std::to_string(std::numeric_limits<uint16_t>::max()));
+            }
+            binnings.push_back(&binning);
+            std::vector<double> centers(binning.numBins());
+            for (int b = 0; b < binning.numBins(); ++b) centers[b] = binning.binCenter(b);
+            fBinCenters.push_back(centers);
+         }
+      }
+
+      const int nobs = fNames.size();
+      if (storage == kFloat32) {
+         fValues.assign(nobs, std::vector<float>(fNEvents));
+         if (data.isWeighted()) fWeights.resize(fNEvents);
+      } else {
+         fBins.resize(nobs);
+      }
+
+      std::map<std::vector<uint16_t>, int> entries;   // kBinIndex: bins of an event -> entry
+      std::vector<uint16_t> bins(nobs);
+      ROOT::Math::KahanSum<double> sumw;
+      for (int i = 0; i < fNEvents; ++i) {
+         const RooArgSet* row = data.get(i);
+         const double w = data.weight();
+         sumw += w;
+         if (storage == kFloat32) {
+            for (int k = 0; k < nobs; ++k) fValues[k][i] = row->getRealValue(fNames[k].c_str());
+            if (!fWeights.empty()) fWeights[i] = w;
+            continue;
+         }
+         for (int k = 0; k < nobs; ++k) bins[k] = binnings[k]->binNumber(row->getRealValue(fNames[k].c_str()));
+         auto entry = entries.emplace(bins, fCounts.size());
+         if (entry.second) {
+            for (int k = 0; k < nobs; ++k) fBins[k].push_back(bins[k]);
+            fCounts.push_back(0);
+         }
+         fCounts[entry.first->second] += w;
+      }
+      fSumWeights = sumw.Sum();
+   }
+
+   int NEvents() const { return fNEvents; }
+   // Rows of the columns: the events (kFloat32) or the occupied bins (kBinIndex)
+   int NEntries() const { return fStorage == kFloat32 ? fNEvents : (int)fCounts.size(); }
+   int NObservables() const { return fNames.size(); }
+   const std::vector<std::string>& Names() const { return fNames; }
+   double SumWeights() const { return fSumWeights; }
+
+   double Value(int entry, int obs) const
+   {
+      return fStorage == kFloat32 ? fValues[obs][entry] : fBinCenters[obs][fBins[obs][entry]];
+   }
+   double Weight(int entry) const
+   {
+      if (fStorage == kBinIndex) return fCounts[entry];
+      return fWeights.empty() ? 1. : fWeights[entry];
+   }
+
+   // Values of observable obs for the entries [begin, begin+n), widened to double
+   void Fill(int obs, int begin, int n, double* out) const
+   {
+      if (fStorage == kFloat32) {
+         const float* values = fValues[obs].data() + begin;
+         for (int i = 0; i < n; ++i) out[i] = values[i];
+      } else {
+         const uint16_t* bins = fBins[obs].data() + begin;
+         const double* centers = fBinCenters[obs].data();
+         for (int i = 0; i < n; ++i) out[i] = centers[bins[i]];
+      }
+   }
+
+   // Memory used by the event data (RooDataSet needs 8 bytes per value and weight)
+   size_t Bytes() const
+   {
+      if (fStorage == kBinIndex) return fCounts.size() * (NObservables() * sizeof(uint16_t) + sizeof(double));
+      return fNEvents * (NObservables() * sizeof(float) + (fWeights.empty() ? 0 : sizeof(float)));
+   }
+
+private:
+   Storage fStorage;
+   int fNEvents;
+   double fSumWeights = 0;
+   std::vector<std::string> fNames;
+   std::vector<std::vector<float>> fValues;         // kFloat32: [observable][event]
+   std::vector<float> fWeights;                     // kFloat32: empty for unweighted data
+   std::vector<std::vector<uint16_t>> fBins;        // kBinIndex: [observable][entry]
+   std::vector<double> fCounts;                     // kBinIndex: sum of the weights of an entry
+   std::vector<std::vector<double>> fBinCenters;    // kBinIndex: [observable][bin]
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Extended (if the pdf can be extended) unbinned NLL of a pdf over a
+// CompactDataSet, to be minimised with RooMinimizer like the RooFit NLL.
+// The entries are processed chunk by chunk: every chunk of a column is
+// widened into a double scratch buffer. With ROOT 6.24-6.26 the pdf computes
+// the values of a whole chunk in one call of the batch interface (RunContext);
+// with other versions it is evaluated entry by entry with getVal, and the
+// observables are restored afterwards. The parameters of the pdf are the
+// servers of the NLL; the pdf itself is not. Constraint terms are not included.
+//////////////////////////////////////////////////////////////////////////////
+
+class CompactNLL : public RooAbsReal {
+public:
+   CompactNLL(const char* name, RooAbsPdf& pdf, std::shared_ptr<const CompactDataSet> data)
+      : RooAbsReal(name, name), _params("params", "parameters", this), _pdf(&pdf), _data(data)
+   {
+      std::unique_ptr<RooArgSet> vars(pdf.getVariables());
+      for (const std::string& obsName : data->Names()) {
+         RooRealVar* obs = dynamic_cast<RooRealVar*>(vars->find(obsName.c_str()));
+         if (!obs) {
+            ::Error("CompactNLL", "observable %s is not a variable of %s", obsName.c_str(), pdf.GetName());
+            continue;
+         }
+         _obs.push_back(obs);
+         _normSet.add(*obs);
+      }
+      std::unique_ptr<RooArgSet> params(pdf.getParameters(_normSet));
+      _params.add(*params);
+   }
+
+   CompactNLL(const CompactNLL& other, const char* name = 0)
+      : RooAbsReal(other, name),
+        _params("params", this, other._params),
+        _pdf(other._pdf),
+        _data(other._data),
+        _obs(other._obs),
+        _normSet(other._normSet)
+   {
+   }
+
+   TObject* clone(const char* newname) const override { return new CompactNLL(*this, newname); }
+
+protected:
+   Double_t evaluate() const override
+   {
+      const int nobs = _obs.size();
+      const int nentries = _data->NEntries();
+      const int chunk = kChunkSize;
+      std::vector<std::vector<double>> scratch(nobs, std::vector<double>(std::min(chunk, nentries)));
+
+#ifndef COMPACT_NLL_RUN_CONTEXT
+      std::vector<double> saved(nobs);
+      for (int k = 0; k < nobs; ++k) saved[k] = _obs[k]->getVal();
+#endif
+
+      ROOT::Math::KahanSum<double> nll;
+      for (int begin = 0; begin < nentries; begin += chunk) {
+         const int n = std::min(chunk, nentries - begin);
+         for (int k = 0; k < nobs; ++k) _data->Fill(k, begin, n, scratch[k].data());
+#ifdef COMPACT_NLL_RUN_CONTEXT
+         RooBatchCompute::RunContext evalData;
+         for (int k = 0; k < nobs; ++k) {
+            evalData.spans[_obs[k]] = RooSpan<const double>(scratch[k].data(), scratch[k].data() + n);
+         }
+         const RooSpan<const double> probs = _pdf->getValues(evalData, &_normSet);
+         const bool scalar = probs.size() == 1;   // a pdf that does not depend on the observables
+#endif
+         for (int i = 0; i < n; ++i) {
+#ifdef COMPACT_NLL_RUN_CONTEXT
+            const double p = probs[scalar ? 0 : i];
+#else
+            for (int k = 0; k < nobs; ++k) _obs[k]->setVal(scratch[k][i]);
+            const double p = _pdf->getVal(_normSet);
+#endif
+            // a vanishing probability would make the NLL infinite, which Minuit cannot handle
+            nll += -_data->Weight(begin + i) * std::log(std::max(p, std::numeric_limits<double>::min()));
+         }
+      }
+#ifndef COMPACT_NLL_RUN_CONTEXT
+      for (int k = 0; k < nobs; ++k) _obs[k]->setVal(saved[k]);
+#endif
+      if (_pdf->canBeExtended()) nll += _pdf->extendedTerm(_data->SumWeights(), &_normSet);
+      return nll.Sum();
+   }
+
+private:
+   static constexpr int kChunkSize = 4096;   // entries per batch: the scratch columns stay in cache
+
+   RooListProxy _params;
+   RooAbsPdf* _pdf;
+   std::shared_ptr<const CompactDataSet> _data;
+   std::vector<RooRealVar*> _obs;
+   RooArgSet _normSet;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef HYPOTHESIS_TEST_CONTOUR_SCAN_H
+#define HYPOTHESIS_TEST_CONTOUR_SCAN_H
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "TError.h"
+#include "TGraph2D.h"
+#include "RooAbsData.h"
+#include "RooRealVar.h"
+#include "RooWorkspace.h"
+#include "RooStats/ModelConfig.h"
+
+#include "ThreadWorkspace.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// Profile likelihood in two parameters (e.g. mu against Bscale), with the
+// other parameters profiled, for 2D confidence contours:
+//   1. one unconditional fit for the MLE and the scan range
+//   2. a coarse nx*ny grid, one row per task on the thread pool; each row
+//      walks away from the MLE and every fit starts from the previous point
+//   3. adaptive refinement: only the cells whose corners lie on both sides
+//      of one of the contour levels are split in four, level by level. The
+//      new points of a level are fitted in parallel, each starting from the
+//      nearest point already fitted
+// Away from the contours the grid stays coarse, so the number of fits grows
+// with the length of the contours rather than with the area of the grid.
+//////////////////////////////////////////////////////////////////////////////
+
+struct ContourScanResult {
+   std::string xName, yName;
+   double xhat = 0, yhat = 0;
+   double nllMin = 0;
+   int fitStatus = 0;                  // status of the unconditional fit
+   std::vector<double> thresholds;   // deltaNLL of the contours, 2 degrees of freedom
+   std::vector<double> x, y, deltaNLL;
+   std::vector<int> status;            // status of the conditional fit of every point
+
+   // -log(lambda) surface; the contours are surface->GetContourList(thresholds[i])
+   TGraph2D* Surface() const
+   {
+      TGraph2D* graph = new TGraph2D(x.size(), const_cast<double*>(x.data()), const_cast<double*>(y.data()),
+                                     const_cast<double*>(deltaNLL.data()));
+      graph->SetName("profile_likelihood_2d");
+      graph->SetTitle(TString::Format(";%s;%s;-log #lambda", xName.c_str(), yName.c_str()));
+      return graph;
+   }
+};
+
+class ContourScan {
+public:
+   ContourScan(const RooWorkspace& w, const RooStats::ModelConfig& mc, const RooAbsData& data, const char* xName,
+               const char* yName, int nThreads = 0)
+      : fXName(xName), fYName(yName), fWorkers(w, mc, data, nThreads)
+   {
+   }
+
+   // Scan MLE +- nSigma errors on a nx*ny grid and refine maxDepth times along the contours of the
+   // confidence levels cls
+   ContourScanResult Run(int nx, int ny, const std::vector<double>& cls, double nSigma = 3, int maxDepth = 3)
+   {
+      ContourScanResult result;
+      result.xName = fXName;
+      result.yName = fYName;
+      for (double cl : cls) result.thresholds.push_back(-std::log(1 - cl));
+      EvalErrorGuard errorGuard;   // the workers fit concurrently until the end of Run
+
+      // 1. fit of both parameters, in the calling thread; its errors set the scan range
+      ThreadWorkspace& first = fWorkers[0];
+      const RooRealVar* xvar = first.Var(fXName);
+      const RooRealVar* yvar = first.Var(fYName);
+      int status = 0;
+      result.nllMin = first.FitFree({fXName, fYName}, status);
+      result.xhat = xvar->getVal();
+      result.yhat = yvar->getVal();
+      const std::vector<double> bestFit = first.GetValues();
+      result.fitStatus = status;
+      if (status > 1) ::Warning("ContourScan", "unconditional fit status %d", status);
+
+      // without an error estimate the whole range of the parameter is scanned
+      const double xerr = xvar->getError() > 0 ? xvar->getError() : xvar->getMax() - xvar->getMin();
+      const double yerr = yvar->getError() > 0 ? yvar->getError() : yvar->getMax() - yvar->getMin();
+      fXMin = std::max(xvar->getMin(), result.xhat - nSigma * xerr);
+      fYMin = std::max(yvar->getMin(), result.yhat - nSigma * yerr);
+      const double xmax = std::min(xvar->getMax(), result.xhat + nSigma * xerr);
+      const double ymax = std::min(yvar->getMax(), result.yhat + nSigma * yerr);
+
+      // lattice of the finest level: the coarse grid points are every 2^maxDepth lattice steps
+      const int coarse = 1 << maxDepth;
+      fXStep = (xmax - fXMin) / (std::max(nx - 1, 1) * coarse);
+      fYStep = (ymax - fYMin) / (std::max(ny - 1, 1) * coarse);
+      fPoints.clear();
+
+      // 2. coarse grid, one task per row walking away from the MLE
+      std::vector<std::vector<Point*>> rows(ny);
+      for (int j = 0; j < ny; ++j) {
+         for (int i = 0; i < nx; ++i) {
+            Point& p = fPoints[Key(i * coarse, j * coarse)];
+            p.x = fXMin + i * coarse * fXStep;
+            p.y = fYMin + j * coarse * fYStep;
+            rows[j].push_back(&p);
+         }
+      }
+      const int ihat = std::min(nx - 1, std::max(0, (int)std::lround((result.xhat - fXMin) / (coarse * fXStep))));
+      for (int j = 0; j < ny; ++j) {
+         const std::vector<Point*>& row = rows[j];
+         fWorkers.Pool().Submit([this, &row, ihat, &bestFit](int worker) {
+            std::vector<double> start = bestFit;
+            for (int i = ihat; i < (int)row.size(); ++i) {
+               Fit(worker, *row[i], start);
+               start = row[i]->values;
+            }
+            start = row[ihat]->values;
+            for (int i = ihat - 1; i >= 0; --i) {
+               Fit(worker, *row[i], start);
+               start = row[i]->values;
+            }
+         }, j);
+      }
+      fWorkers.Pool().Wait();
+      for (auto& p : fPoints) p.second.deltaNLL = p.second.nll - result.nllMin;
+
+      // 3. split the cells crossed by a contour, level by level
+      std::vector<Cell> cells;
+      for (int j = 0; j + 1 < ny; ++j) {
+         for (int i = 0; i + 1 < nx; ++i) cells.push_back(Cell{i * coarse, j * coarse, coarse});
+      }
+      for (int depth = 0; depth < maxDepth; ++depth) {
+         std::vector<Cell> children;
+         std::vector<std::pair<Point*, const Point*>> added;   // new point, nearest fitted point
+         for (const Cell& cell : cells) {
+            if (!Crossed(cell, result.thresholds)) continue;
+            const int h = cell.size / 2;
+            const int offsets[5][2] = {{h, 0}, {0, h}, {h, h}, {2 * h, h}, {h, 2 * h}};
+            for (const auto& o : offsets) {
+               const Key key(cell.ix + o[0], cell.iy + o[1]);
+               if (fPoints.count(key)) continue;
+               Point& p = fPoints[key];
+               p.x = fXMin + key.first * fXStep;
+               p.y = fYMin + key.second * fYStep;
+               added.emplace_back(&p, &Nearest(cell, key));
+            }
+            children.push_back(Cell{cell.ix, cell.iy, h});
+            children.push_back(Cell{cell.ix + h, cell.iy, h});
+            children.push_back(Cell{cell.ix, cell.iy + h, h});
+            children.push_back(Cell{cell.ix + h, cell.iy + h, h});
+         }
+         if (added.empty()) break;
+
+         for (size_t k = 0; k < added.size(); ++k) {
+            Point* p = added[k].first;
+            const Point* start = added[k].second;
+            fWorkers.Pool().Submit([this, p, start](int worker) { Fit(worker, *p, start->values); }, k);
+         }
+         fWorkers.Pool().Wait();
+         for (auto& a : added) a.first->deltaNLL = a.first->nll - result.nllMin;
+         cells.swap(children);
+      }
+
+      const Point* lowest = 0;
+      for (const auto& p : fPoints) {
+         result.x.push_back(p.second.x);
+         result.y.push_back(p.second.y);
+         result.deltaNLL.push_back(p.second.deltaNLL);
+         result.status.push_back(p.second.status);
+         if (p.second.status <= 1 && (!lowest || p.second.deltaNLL < lowest->deltaNLL)) lowest = &p.second;
+      }
+      // a conditional fit below the unconditional minimum (beyond the Minuit tolerance): the latter
+      // did not find the global minimum
+      if (lowest && lowest->deltaNLL < -1e-3) {
+         ::Warning("ContourScan", "deltaNLL = %g at %s = %g, %s = %g: the unconditional fit missed the minimum,"
+                   " the contours are not reliable", lowest->deltaNLL, fXName.c_str(), lowest->x, fYName.c_str(), lowest->y);
+      }
+      return result;
+   }
+
+private:
+   typedef std::pair<int, int> Key;   // lattice coordinates
+
+   struct Point {
+      double x = 0, y = 0;
+      double nll = 0;
+      double deltaNLL = 0;
+      int status = 0;
+      std::vector<double> values;   // best fit parameters, to warm start neighbouring fits
+   };
+
+   struct Cell {
+      int ix, iy, size;   // lower left corner and size in lattice units
+   };
+
+   // A contour crosses the cell if its level lies between the values at the corners. Corners
+   // whose fit failed (status > 1) are left out; with less than two good corners the cell is not split.
+   bool Crossed(const Cell& cell, const std::vector<double>& thresholds) const
+   {
+      double lo = 0, hi = 0;
+      int ngood = 0;
+      for (int c = 0; c < 4; ++c) {
+         const Point& corner = fPoints.at(Key(cell.ix + (c & 1) * cell.size, cell.iy + (c >> 1) * cell.size));
+         if (corner.status > 1) continue;
+         lo = ngood == 0 ? corner.deltaNLL : std::min(lo, corner.deltaNLL);
+         hi = ngood == 0 ? corner.deltaNLL : std::max(hi, corner.deltaNLL);
+         ++ngood;
+      }
+      if (ngood < 2) return false;
+      for (double t : thresholds) {
+         if (lo < t && hi >= t) return true;
+      }
+      return false;
+   }
+
+   // The corner of the cell closest to a new point
+   const Point& Nearest(const Cell& cell, const Key& key) const
+   {
+      const Point* nearest = 0;
+      double best = 0;
+      for (int c = 0; c < 4; ++c) {
+         const Key corner(cell.ix + (c & 1) * cell.size, cell.iy + (c >> 1) * cell.size);
+         const double dx = (corner.first - key.first) * fXStep, dy = (corner.second - key.second) * fYStep;
+         const double d = dx * dx + dy * dy;
+         if (!nearest || d < best) {
+            nearest = &fPoints.at(corner);
+            best = d;
+         }
+      }
+      return *nearest;
+   }
+
+   // Profiled NLL at (point.x, point.y), starting from the given parameter values
+   void Fit(int worker, Point& point, const std::vector<double>& start)
+   {
+      ThreadWorkspace& ctx = fWorkers[worker];
+      ctx.SetValues(start);
+      point.nll = ctx.FitFixed({{fXName, point.x}, {fYName, point.y}}, point.status);
+      point.values = ctx.GetValues();
+   }
+
+   std::string fXName, fYName;
+   double fXMin = 0, fYMin = 0, fXStep = 0, fYStep = 0;
+   std::map<Key, Point> fPoints;
+   FitWorkers fWorkers;
+};
+
+#endif
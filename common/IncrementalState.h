@@ -0,0 +1,101 @@
+#ifndef HYPOTHESIS_TEST_INCREMENTAL_STATE_H
+#define HYPOTHESIS_TEST_INCREMENTAL_STATE_H
+
+#include <memory>
+#include <string>
+
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TH1D.h"
+#include "TParameter.h"
+#include "TSystem.h"
+#include "RooAbsBinning.h"
+#include "RooAbsData.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooDataHist.h"
+#include "RooRealVar.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// State kept between runs when the data only grow: the per-bin event counts
+// of the observable (the sufficient statistics of the binned likelihood)
+// and the best fit parameters of the previous run. A new run only reads the
+// new events, adds them to the counts, and starts the fits from the previous
+// best fit, so its cost depends on the new data and the number of bins, not
+// on the total number of events.
+//////////////////////////////////////////////////////////////////////////////
+
+class IncrementalState {
+public:
+   // Read the state written by the previous run, if there is one
+   explicit IncrementalState(const char* fileName) : fFileName(fileName)
+   {
+      if (gSystem->AccessPathName(fileName)) return;  // no previous run
+      TDirectory::TContext context;
+      std::unique_ptr<TFile> file(TFile::Open(fileName));
+      if (!file) return;
+
+      TH1D* counts = (TH1D*) file->Get("counts");
+      if (counts) {
+         counts->SetDirectory(0);
+         fCounts.reset(counts);
+      }
+      fMLE.reset((RooArgSet*) file->Get("mle"));
+      TParameter<int>* nruns = (TParameter<int>*) file->Get("nruns");
+      if (nruns) fNRuns = nruns->GetVal();
+      delete nruns;
+   }
+
+   bool HasHistory() const { return fCounts != nullptr; }
+   int NRuns() const { return fNRuns; }
+   double NEvents() const { return fCounts ? fCounts->GetSumOfWeights() : 0; }
+
+   // Add the events of a new dataset to the counts, in the binning of x
+   void Append(const RooAbsData& data, const RooRealVar& x)
+   {
+      if (!fCounts) {
+         const RooAbsBinning& binning = x.getBinning();
+         fCounts.reset(new TH1D("counts", x.GetTitle(), binning.numBins(), binning.array()));
+         fCounts->SetDirectory(0);
+         fCounts->Sumw2();
+      }
+      for (int i = 0; i < data.numEntries(); ++i) {
+         const RooArgSet* row = data.get(i);
+         fCounts->Fill(row->getRealValue(x.GetName()), data.weight());
+      }
+      ++fNRuns;
+   }
+
+   // All the events seen so far as binned data of x
+   RooDataHist* BinnedData(RooRealVar& x, const char* name) const
+   {
+      return new RooDataHist(name, name, RooArgList(x), fCounts.get());
+   }
+
+   // Set the parameters to the best fit of the previous run, if any
+   void WarmStart(RooArgSet& params) const
+   {
+      if (fMLE) params.assignValueOnly(*fMLE);
+   }
+
+   void SetMLE(const RooArgSet& params) { fMLE.reset((RooArgSet*) params.snapshot()); }
+
+   void Save() const
+   {
+      TDirectory::TContext context;
+      TFile file(fFileName.c_str(), "RECREATE");
+      if (fCounts) fCounts->Write("counts");
+      if (fMLE) file.WriteObject(fMLE.get(), "mle");
+      TParameter<int> nruns("nruns", fNRuns);
+      nruns.Write();
+      file.Close();
+   }
+
+private:
+   std::string fFileName;
+   std::unique_ptr<TH1D> fCounts;
+   std::unique_ptr<RooArgSet> fMLE;
+   int fNRuns = 0;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef HYPOTHESIS_TEST_PIPELINED_TOY_MC_SAMPLER_H
+#define HYPOTHESIS_TEST_PIPELINED_TOY_MC_SAMPLER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TError.h"
+#include "RooArgSet.h"
+#include "RooDataSet.h"
+#include "RooRealVar.h"
+#include "RooWorkspace.h"
+#include "RooStats/ProfileLikelihoodTestStat.h"
+#include "RooStats/SamplingDistribution.h"
+#include "RooStats/ToyMCSampler.h"
+
+#include "ThreadWorkspace.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// ToyMCSampler for the profile likelihood ratio that runs the three stages of
+// every toy as a pipeline instead of strictly in sequence:
+//   1. generation, in the calling thread (it uses the global random generator
+//      and the model of the main workspace, exactly like ToyMCSampler)
+//   2. conditional fit (POI fixed at the tested value)  } tasks of a work-stealing
+//   3. unconditional fit                                } pool, one workspace copy per worker
+// While the workers fit toy N the calling thread already generates toy N+1, and
+// the two fits of the same toy run concurrently on different workers. At most
+// maxToysInFlight toys are waiting or being fitted, which bounds the memory.
+//
+// The toy test statistic is computed from the two fits, while the observed
+// value is evaluated by the ProfileLikelihoodTestStat the sampler is given.
+// To keep the two definitions identical the one-sided options are set only
+// through the sampler (SetOneSided, SetOneSidedDiscovery), which sets them on
+// the test statistic as well; the constructor resets the test statistic to
+// two-sided. Nuisance parameter priors are not supported by the pipeline and
+// fall back to the serial ToyMCSampler.
+//
+// With SetSequentialSampling the toys of the tested hypothesis are generated
+// in batches and sampling stops as soon as CLs+b, the fraction of toys with a
+// test statistic at or above the observed value, is known precisely enough,
+// or CLs is clearly on one side of the test size. The number of toys set with
+// FrequentistCalculator::SetToys is then the maximum per point. The toys of
+// the other (background) hypothesis are never stopped early: besides CLb
+// (the same right tail) they give the expected limits and their bands, which
+// are quantiles of that distribution.
+//////////////////////////////////////////////////////////////////////////////
+
+class PipelinedToyMCSampler : public RooStats::ToyMCSampler {
+public:
+   PipelinedToyMCSampler(RooStats::ProfileLikelihoodTestStat& ts, Int_t ntoys, const RooWorkspace& w,
+                         int nWorkers = 0, int maxToysInFlight = 0)
+      : ToyMCSampler(ts, ntoys),
+        fProfileLikelihood(ts),
+        fWorkspace(w),
+        fNWorkers(nWorkers > 0 ? nWorkers : std::max(1u, std::thread::hardware_concurrency())),
+        fMaxToysInFlight(maxToysInFlight > 0 ? maxToysInFlight : 2 * fNWorkers)
+   {
+      fProfileLikelihood.SetOneSided(false);
+   }
+
+   // One-sided options of both the toy and the observed test statistic
+   void SetOneSided(bool flag)
+   {
+      fOneSided = flag;
+      fOneSidedDiscovery = false;
+      fProfileLikelihood.SetOneSided(flag);
+      fObservedValid = false;
+   }
+   void SetOneSidedDiscovery(bool flag)
+   {
+      fOneSidedDiscovery = flag;
+      fOneSided = false;
+      fProfileLikelihood.SetOneSidedDiscovery(flag);
+      fObservedValid = false;
+   }
+
+   // Stop the toys of the tested hypothesis after at least minToys when the binomial error on
+   // CLs+b is below relPrecision times its value, or when CLs is more than nSigma errors away
+   // from size. CLs below size can only be decided once the CLb of the point is known; CLs above
+   // size already follows from CLs+b, since CLb <= 1.
+   // observed is the data the p-values are computed for.
+   void SetSequentialSampling(RooAbsData& observed, double size, int minToys = 50, int batchSize = 50,
+                              double relPrecision = 0.1, double nSigma = 3)
+   {
+      fObservedData = &observed;
+      fObservedValid = false;
+      fSize = size;
+      fMinToys = minToys;
+      fBatchSize = std::max(batchSize, 1);
+      fRelPrecision = relPrecision;
+      fNSigma = nSigma;
+      fCLb = -1;
+      fCLbPOI.clear();
+   }
+
+   // Toys generated and toys skipped because a fit failed (status > 1) since the last reset
+   int NToysRun() const { return fNToysRun; }
+   int NToysSkipped() const { return fNToysSkipped; }
+   void ResetToyCounts() { fNToysRun = fNToysSkipped = 0; }
+
+   void SetParametersForTestStat(const RooArgSet& nullpoi) override
+   {
+      ToyMCSampler::SetParametersForTestStat(nullpoi);
+      fTestPOISet.reset(static_cast<RooArgSet*>(nullpoi.snapshot()));
+      fObservedValid = false;
+      fTestPOI.clear();
+      fTestPOINames.clear();
+      for (RooAbsArg* arg : nullpoi) {
+         RooAbsReal* poi = dynamic_cast<RooAbsReal*>(arg);
+         if (!poi) continue;
+         fTestPOI.emplace_back(poi->GetName(), poi->getVal());
+         fTestPOINames.push_back(poi->GetName());
+      }
+   }
+
+   RooDataSet* GetSamplingDistributions(RooArgSet& paramPoint) override
+   {
+      if (fPriorNuisance || fTestPOI.empty()) return ToyMCSampler::GetSamplingDistributions(paramPoint);
+
+      std::vector<double> values, weights;
+      if (fObservedData) {
+         RunSequential(paramPoint, values, weights);
+      } else {
+         RunToys(paramPoint, fNToys, values, weights);
+      }
+      return MakeDataSet(values, weights);
+   }
+
+   RooStats::SamplingDistribution* GetSamplingDistribution(RooArgSet& paramPoint) override
+   {
+      std::unique_ptr<RooDataSet> toys(GetSamplingDistributions(paramPoint));
+      return new RooStats::SamplingDistribution(toys->GetName(), toys->GetTitle(), *toys);
+   }
+
+protected:
+   struct Toy {
+      std::unique_ptr<RooAbsData> data;
+      ParameterValues globals;
+      std::atomic<int> pending{2};
+      double nllCond = 0, nllUncond = 0, muhat = 0;
+      int statusCond = 0, statusUncond = 0;
+   };
+
+   // Run ntoys toys through the pipeline and append the test statistic values and weights
+   // of the successful ones
+   void RunToys(RooArgSet& paramPoint, int ntoys, std::vector<double>& values, std::vector<double>& weights)
+   {
+      if (!CheckConfig()) return;
+      SetupWorkers();
+      EvalErrorGuard errorGuard;
+
+      std::unique_ptr<RooArgSet> allVars(fPdf->getVariables());
+      std::unique_ptr<RooArgSet> saveAll(static_cast<RooArgSet*>(allVars->snapshot()));
+      const ParameterValues start = ToValues(paramPoint);
+
+      std::vector<double> toyValues(ntoys, std::numeric_limits<double>::quiet_NaN());
+      std::vector<double> toyWeights(ntoys, 1.);
+      std::mutex mutex;
+      std::condition_variable slotFree;
+      int inFlight = 0;
+
+      for (int i = 0; i < ntoys; ++i) {
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFree.wait(lock, [&] { return inFlight < fMaxToysInFlight; });
+            ++inFlight;
+         }
+
+         std::shared_ptr<Toy> toy = std::make_shared<Toy>();
+         {
+            // the workers create and delete RooFit objects at the same time
+            std::lock_guard<std::mutex> lock(ThreadWorkspace::ConstructionMutex());
+            toy->data.reset(GenerateToyData(paramPoint, toyWeights[i]));
+         }
+         if (fGlobalObservables) toy->globals = ToValues(*fGlobalObservables);
+
+         // whichever fit finishes last computes the test statistic and frees the slot
+         auto finish = [&, toy, i]() {
+            if (--toy->pending > 0) return;
+            toyValues[i] = ProfileLikelihoodRatio(*toy);
+            {
+               std::lock_guard<std::mutex> lock(ThreadWorkspace::ConstructionMutex());
+               toy->data.reset();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            --inFlight;
+            slotFree.notify_one();
+         };
+         fWorkers->Pool().Submit([this, toy, &start, finish](int worker) { Fit(worker, *toy, start, true); finish(); }, 2 * i);
+         fWorkers->Pool().Submit([this, toy, &start, finish](int worker) { Fit(worker, *toy, start, false); finish(); }, 2 * i + 1);
+      }
+      fWorkers->Pool().Wait();
+      allVars->assign(*saveAll);
+
+      int nfailed = 0;
+      for (int i = 0; i < ntoys; ++i) {
+         if (std::isnan(toyValues[i])) {
+            ++nfailed;
+            continue;
+         }
+         values.push_back(toyValues[i]);
+         weights.push_back(toyWeights[i]);
+      }
+      fNToysRun += ntoys;
+      fNToysSkipped += nfailed;
+      if (nfailed > 0) {
+         ::Warning("PipelinedToyMCSampler", "%d of %d toys skipped because a fit did not converge", nfailed, ntoys);
+      }
+   }
+
+   // Toys of the tested hypothesis: batches until CLs+b is settled or fNToys toys have been generated.
+   // Toys of the other hypothesis: always fNToys. The CLb they give is kept for the tested point, in
+   // case its toys are requested again (HypoTestInverter generates the S+B toys of a point first).
+   void RunSequential(RooArgSet& paramPoint, std::vector<double>& values, std::vector<double>& weights)
+   {
+      const double tobs = ObservedTestStatistic();
+      double p = 0, error = 0;
+      if (!IsTestedHypothesis(paramPoint)) {
+         RunToys(paramPoint, fNToys, values, weights);
+         TailProbability(values, weights, tobs, p, error);
+         fCLb = p;
+         fCLbPOI = fTestPOI;
+         ::Info("PipelinedToyMCSampler", "CLb = %g +- %g after %d toys", p, error, (int)values.size());
+         return;
+      }
+
+      int ntoys = 0;
+      while (ntoys < fNToys) {
+         const int nbatch = std::min(fBatchSize, fNToys - ntoys);
+         RunToys(paramPoint, nbatch, values, weights);
+         ntoys += nbatch;
+         TailProbability(values, weights, tobs, p, error);
+         if (ntoys >= fMinToys && Settled(p, error)) break;
+      }
+      ::Info("PipelinedToyMCSampler", "CLs+b = %g +- %g after %d toys", p, error, ntoys);
+   }
+
+   RooDataSet* MakeDataSet(const std::vector<double>& values, const std::vector<double>& weights)
+   {
+      RooRealVar ts(GetTestStatistic()->GetVarName(), "test statistic", 0);
+      RooRealVar weight("weight", "weight", 1);
+      const std::string name = GetSamplingDistName();
+      RooDataSet* result = new RooDataSet(name.c_str(), name.c_str(), RooArgSet(ts, weight), RooFit::WeightVar(weight));
+      for (size_t i = 0; i < values.size(); ++i) {
+         ts.setVal(values[i]);
+         result->add(RooArgSet(ts), weights[i]);
+      }
+      return result;
+   }
+
+private:
+   static ParameterValues ToValues(const RooArgSet& set)
+   {
+      ParameterValues values;
+      for (RooAbsArg* arg : set) {
+         RooAbsReal* var = dynamic_cast<RooAbsReal*>(arg);
+         if (var) values.emplace_back(var->GetName(), var->getVal());
+      }
+      return values;
+   }
+
+   // The toys of the tested hypothesis give CLs+b, those of the other hypothesis CLb
+   bool IsTestedHypothesis(const RooArgSet& paramPoint) const
+   {
+      for (const auto& poi : fTestPOI) {
+         const RooAbsReal* value = dynamic_cast<const RooAbsReal*>(paramPoint.find(poi.first.c_str()));
+         if (!value || std::fabs(value->getVal() - poi.second) > 1e-6 * (1 + std::fabs(poi.second))) return false;
+      }
+      return true;
+   }
+
+   double ObservedTestStatistic()
+   {
+      if (!fObservedValid) {
+         std::unique_ptr<RooArgSet> allVars(fPdf->getVariables());
+         std::unique_ptr<RooArgSet> saveAll(static_cast<RooArgSet*>(allVars->snapshot()));
+         fObserved = EvaluateTestStatistic(*fObservedData, *fTestPOISet);
+         allVars->assign(*saveAll);
+         fObservedValid = true;
+      }
+      return fObserved;
+   }
+
+   // Fraction of toys at or above the observed value and its binomial error. This right tail is
+   // CLs+b for the toys of the tested hypothesis and CLb (1 - AlternatePValue in RooStats) for the
+   // background toys. The estimate is pulled slightly towards 1/2 so that an empty tail still has an error.
+   static void TailProbability(const std::vector<double>& values, const std::vector<double>& weights, double tobs,
+                               double& p, double& error)
+   {
+      double sumw = 0, sumw2 = 0, tail = 0;
+      for (size_t i = 0; i < values.size(); ++i) {
+         sumw += weights[i];
+         sumw2 += weights[i] * weights[i];
+         if (values[i] >= tobs) tail += weights[i];
+      }
+      const double neff = sumw2 > 0 ? sumw * sumw / sumw2 : 0;
+      const double frac = sumw > 0 ? tail / sumw : 0;
+      p = (frac * neff + 0.5) / (neff + 1);
+      error = std::sqrt(p * (1 - p) / (neff + 1));
+   }
+
+   // clsb is CLs+b of the tested hypothesis and error its binomial error
+   bool Settled(double clsb, double error) const
+   {
+      if (error <= fRelPrecision * clsb) return true;
+
+      // CLb <= 1: if CLs+b is clearly above size, so is CLs = CLs+b/CLb
+      if (clsb - fNSigma * error > fSize) return true;
+
+      // below size CLs needs the CLb of this point, which is only known when its B toys ran first
+      if (fCLb <= 0 || fCLbPOI != fTestPOI) return false;
+      const double clb = fCLb;
+      const double cls = clsb / clb;
+      const double clsError = error / clb;
+      return std::fabs(cls - fSize) > fNSigma * clsError;
+   }
+
+   // The workspace copies are made once per pdf, the pool is kept alive between calls
+   void SetupWorkers()
+   {
+      if (fWorkers && fWorkerPdf == fPdf->GetName()) return;
+      fWorkers.reset();
+      fWorkers.reset(new FitWorkers(fWorkspace, fPdf->GetName(), *fObservables, fNuisancePars, fNWorkers));
+      fWorkerPdf = fPdf->GetName();
+   }
+
+   void Fit(int worker, Toy& toy, const ParameterValues& start, bool conditional)
+   {
+      ThreadWorkspace& ctx = (*fWorkers)[worker];
+      ctx.SetValues(start);
+      ctx.SetValues(toy.globals);
+      ctx.SetData(*toy.data);
+
+      // both fits start from the tested value of the POI
+      if (conditional) {
+         toy.nllCond = ctx.FitFixed(fTestPOI, toy.statusCond);
+      } else {
+         ctx.SetValues(fTestPOI);
+         toy.nllUncond = ctx.FitFree(fTestPOINames, toy.statusUncond);
+         toy.muhat = ctx.Var(fTestPOI[0].first)->getVal();
+      }
+   }
+
+   // Same definition as ProfileLikelihoodTestStat: -log of the profile likelihood ratio,
+   // set to zero on the side excluded by the one-sided options. NaN flags a failed fit
+   // (status 0 is a good fit, 1 a forced positive definite covariance, which is fine here).
+   double ProfileLikelihoodRatio(const Toy& toy) const
+   {
+      if (toy.statusCond > 1 || toy.statusUncond > 1) return std::numeric_limits<double>::quiet_NaN();
+      const double mu = fTestPOI[0].second;
+      if (fOneSided && toy.muhat > mu) return 0;
+      if (fOneSidedDiscovery && toy.muhat < mu) return 0;
+      return std::max(toy.nllCond - toy.nllUncond, 0.);
+   }
+
+   RooStats::ProfileLikelihoodTestStat& fProfileLikelihood;
+   const RooWorkspace& fWorkspace;
+   int fNWorkers;
+   int fMaxToysInFlight;
+   bool fOneSided = false;
+   bool fOneSidedDiscovery = false;
+   ParameterValues fTestPOI;
+   std::vector<std::string> fTestPOINames;
+   std::unique_ptr<RooArgSet> fTestPOISet;
+   int fNToysRun = 0;
+   int fNToysSkipped = 0;
+
+   RooAbsData* fObservedData = 0;   // set for sequential sampling
+   bool fObservedValid = false;
+   double fObserved = 0;
+   double fSize = 0.05;
+   int fMinToys = 0;
+   int fBatchSize = 1;
+   double fRelPrecision = 0;
+   double fNSigma = 0;
+   double fCLb = -1;          // CLb of the point fCLbPOI
+   ParameterValues fCLbPOI;
+
+   std::string fWorkerPdf;
+   std::unique_ptr<FitWorkers> fWorkers;
+};
+
+#endif
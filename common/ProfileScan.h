@@ -0,0 +1,295 @@
+#ifndef HYPOTHESIS_TEST_PROFILE_SCAN_H
+#define HYPOTHESIS_TEST_PROFILE_SCAN_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "TError.h"
+#include "TGraph.h"
+#include "TSpline.h"
+#include "Math/QuantFuncMathCore.h"
+#include "RooAbsData.h"
+#include "RooRealVar.h"
+#include "RooWorkspace.h"
+#include "RooStats/ModelConfig.h"
+
+#include "ThreadWorkspace.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// Profile likelihood curve and interval of one parameter of interest from a
+// single computation:
+//   1. one unconditional fit for the MLE
+//   2. the profiled NLL on a coarse grid, split in segments that run in
+//      parallel; each segment walks away from the MLE. The first point of a
+//      segment starts from the unconditional best fit (the segments do not
+//      wait for each other), the next ones from the previous point
+//   3. a spline through the grid locates the crossings of the threshold
+//      (0.5 for 68.3%, 1.92 for 95%), which are then refined with a few real
+//      fits, the lower and upper edge in parallel. A crossing outside the
+//      scanned range is searched for beyond it, up to the range of the
+//      parameter
+// The result contains the interval and all the evaluated points, so drawing
+// the curve costs no further fits.
+//////////////////////////////////////////////////////////////////////////////
+
+struct ProfileScanResult {
+   std::string poiName;
+   double mle = 0;
+   double nllMin = 0;
+   int fitStatus = 0;             // status of the unconditional fit
+   double threshold = 0;          // deltaNLL at the interval edges
+   double lower = 0, upper = 0;   // interval edges, NaN if beyond the range of the parameter
+   std::vector<double> poi;       // evaluated points, sorted
+   std::vector<double> deltaNLL;
+   std::vector<int> status;       // status of the conditional fit of every point
+
+   // Curve -log(lambda) = NLL - NLLmin, to be drawn with "AL" or "ALP"
+   TGraph* Curve() const
+   {
+      TGraph* graph = new TGraph(poi.size(), poi.data(), deltaNLL.data());
+      graph->SetName("profile_likelihood");
+      graph->SetTitle(TString::Format(";%s;-log #lambda(%s)", poiName.c_str(), poiName.c_str()));
+      return graph;
+   }
+};
+
+class ProfileScan {
+public:
+   ProfileScan(const RooWorkspace& w, const RooStats::ModelConfig& mc, const RooAbsData& data, int nThreads = 0)
+      : fPOIName(mc.GetParametersOfInterest()->first()->GetName()), fWorkers(w, mc, data, nThreads)
+   {
+   }
+
+   // Scan [xmin,xmax] with npoints points and find the two-sided interval at confidence level cl
+   ProfileScanResult Run(double xmin, double xmax, int npoints, double cl, double tolerance = 1e-3)
+   {
+      ProfileScanResult result;
+      result.poiName = fPOIName;
+      const double z = ROOT::Math::normal_quantile(0.5 * (1 + cl), 1);
+      result.threshold = 0.5 * z * z;
+      EvalErrorGuard errorGuard;   // the workers fit concurrently until the end of Run
+
+      // 1. unconditional fit, in the calling thread
+      ThreadWorkspace& first = fWorkers[0];
+      int status = 0;
+      result.nllMin = first.FitFree({fPOIName}, status);
+      result.mle = first.Var(fPOIName)->getVal();
+      const std::vector<double> bestFit = first.GetValues();
+      result.fitStatus = status;
+      if (status > 1) ::Warning("ProfileScan", "unconditional fit status %d", status);
+
+      // 2. coarse grid, walking away from the MLE on both sides
+      std::vector<Point> points(npoints);
+      for (int i = 0; i < npoints; ++i) points[i].x = xmin + (xmax - xmin) * i / std::max(npoints - 1, 1);
+      std::vector<std::vector<int>> segments = Segments(points, result.mle);
+      for (size_t k = 0; k < segments.size(); ++k) {
+         const std::vector<int>& segment = segments[k];
+         fWorkers.Pool().Submit([this, &points, &bestFit, &segment](int worker) {
+            std::vector<double> start = bestFit;
+            for (int i : segment) {
+               Fit(worker, points[i], start);
+               start = points[i].values;
+            }
+         }, k);
+      }
+      fWorkers.Pool().Wait();
+      for (auto& p : points) p.deltaNLL = p.nll - result.nllMin;
+
+      // 3. refine the crossings below and above the MLE
+      const double step = npoints > 1 ? (xmax - xmin) / (npoints - 1) : std::max(xmax - xmin, 1e-3);
+      Point best;
+      best.x = result.mle;
+      best.nll = result.nllMin;
+      best.status = status;
+      best.values = bestFit;
+      std::vector<Point> lowerPoints, upperPoints;
+      fWorkers.Pool().Submit([&](int worker) {
+         result.lower = Refine(worker, points, best, result.threshold, tolerance, false, lowerPoints, step);
+      }, 0);
+      fWorkers.Pool().Submit([&](int worker) {
+         result.upper = Refine(worker, points, best, result.threshold, tolerance, true, upperPoints, step);
+      }, 1);
+      fWorkers.Pool().Wait();
+
+      points.insert(points.end(), lowerPoints.begin(), lowerPoints.end());
+      points.insert(points.end(), upperPoints.begin(), upperPoints.end());
+      points.push_back(best);
+      std::sort(points.begin(), points.end(), [](const Point& a, const Point& b) { return a.x < b.x; });
+      double deltaMin = 0, xMin = result.mle;
+      for (const auto& p : points) {
+         result.poi.push_back(p.x);
+         result.deltaNLL.push_back(p.deltaNLL);
+         result.status.push_back(p.status);
+         if (p.status <= 1 && p.deltaNLL < deltaMin) {
+            deltaMin = p.deltaNLL;
+            xMin = p.x;
+         }
+      }
+      // a conditional fit below the unconditional minimum: the latter did not find the global minimum
+      if (deltaMin < -tolerance) {
+         ::Warning("ProfileScan", "deltaNLL = %g at %s = %g: the unconditional fit missed the minimum,"
+                   " the interval is not reliable", deltaMin, fPOIName.c_str(), xMin);
+      }
+      return result;
+   }
+
+private:
+   struct Point {
+      double x = 0;
+      double nll = 0;
+      double deltaNLL = 0;
+      int status = 0;
+      std::vector<double> values;   // best fit parameters, to warm start neighbouring fits
+   };
+
+   // Split the grid in contiguous segments ordered away from the MLE, about two per worker
+   std::vector<std::vector<int>> Segments(const std::vector<Point>& points, double mle) const
+   {
+      std::vector<int> below, above;
+      for (int i = points.size() - 1; i >= 0; --i) {
+         if (points[i].x < mle) below.push_back(i);
+      }
+      for (int i = 0; i < (int)points.size(); ++i) {
+         if (points[i].x >= mle) above.push_back(i);
+      }
+
+      const int nsegments = 2 * fWorkers.Size();
+      const int size = std::max<int>(1, (points.size() + nsegments - 1) / nsegments);
+      std::vector<std::vector<int>> segments;
+      for (const std::vector<int>* side : {&below, &above}) {
+         for (size_t i = 0; i < side->size(); i += size) {
+            segments.emplace_back(side->begin() + i, side->begin() + std::min(side->size(), i + size));
+         }
+      }
+      return segments;
+   }
+
+   // Profiled NLL at point.x, starting from the given parameter values
+   void Fit(int worker, Point& point, const std::vector<double>& start)
+   {
+      ThreadWorkspace& ctx = fWorkers[worker];
+      ctx.SetValues(start);
+      point.nll = ctx.FitFixed({{fPOIName, point.x}}, point.status);
+      point.values = ctx.GetValues();
+   }
+
+   // Locate the crossing of the threshold on one side of the MLE: first on a spline through
+   // the grid, then by secant steps with real fits inside the bracketing interval. If the grid
+   // does not reach the threshold, the scan continues outwards with doubling steps, starting with
+   // the grid spacing; NaN if the crossing is beyond the range of the parameter. Points whose fit
+   // failed (status > 1) are never used to bracket the crossing.
+   double Refine(int worker, const std::vector<Point>& grid, const Point& best, double threshold, double tolerance,
+                 bool upperSide, std::vector<Point>& added, double step)
+   {
+      const double mle = best.x;
+      std::vector<const Point*> side;
+      for (const auto& p : grid) {
+         if (p.status <= 1 && (upperSide ? p.x >= mle : p.x <= mle)) side.push_back(&p);
+      }
+      // ordered away from the MLE
+      std::sort(side.begin(), side.end(), [upperSide](const Point* a, const Point* b) {
+         return upperSide ? a->x < b->x : a->x > b->x;
+      });
+
+      int bracket = -1;
+      for (size_t i = 0; i < side.size(); ++i) {
+         if (side[i]->deltaNLL >= threshold) {
+            bracket = i;
+            break;
+         }
+      }
+      Point inner, outer;
+      double x;
+      if (bracket >= 0) {
+         // inner point of the bracket: the previous grid point or the MLE itself
+         inner = bracket > 0 ? *side[bracket - 1] : best;
+         outer = *side[bracket];
+         x = SplineCrossing(grid, threshold, inner.x, outer.x);
+      } else {
+         const RooRealVar* poi = fWorkers[worker].Var(fPOIName);
+         const double limit = upperSide ? poi->getMax() : poi->getMin();
+         inner = side.empty() ? best : *side.back();
+         bool found = false;
+         for (int iter = 0; iter < 30 && inner.x != limit; ++iter) {
+            Point p;
+            p.x = upperSide ? std::min(inner.x + step, limit) : std::max(inner.x - step, limit);
+            Fit(worker, p, inner.values);
+            p.deltaNLL = p.nll - best.nll;
+            added.push_back(p);
+            if (p.status > 1) {
+               // step over the failed point, from the last good one
+               step = std::fabs(p.x - inner.x) * 2;
+               if (p.x == limit) break;
+               continue;
+            }
+            if (p.deltaNLL >= threshold) {
+               outer = p;
+               found = true;
+               break;
+            }
+            inner = p;
+            step *= 2;
+         }
+         if (!found) {
+            ::Warning("ProfileScan", "%s limit of %s is beyond the range of the parameter",
+                      upperSide ? "upper" : "lower", fPOIName.c_str());
+            return std::numeric_limits<double>::quiet_NaN();
+         }
+         if (std::fabs(outer.deltaNLL - threshold) < tolerance) return outer.x;
+         x = inner.x + (threshold - inner.deltaNLL) * (outer.x - inner.x) / (outer.deltaNLL - inner.deltaNLL);
+      }
+      double crossing = x;
+      for (int iter = 0; iter < 10; ++iter) {
+         Point p;
+         p.x = x;
+         Fit(worker, p, inner.values);
+         p.deltaNLL = p.nll - best.nll;
+         added.push_back(p);
+         if (p.status > 1) {
+            // retry closer to the inner point, which is known to be good
+            x = 0.5 * (inner.x + x);
+            continue;
+         }
+         crossing = p.x;
+         if (std::fabs(p.deltaNLL - threshold) < tolerance) break;
+
+         if (p.deltaNLL < threshold) inner = p;
+         else outer = p;
+         // secant step, falling back to bisection when it leaves the bracket
+         const double slope = (outer.deltaNLL - inner.deltaNLL) / (outer.x - inner.x);
+         x = slope != 0 ? inner.x + (threshold - inner.deltaNLL) / slope : 0.5 * (inner.x + outer.x);
+         if ((x - inner.x) * (x - outer.x) >= 0) x = 0.5 * (inner.x + outer.x);
+      }
+      return crossing;
+   }
+
+   // Crossing of the threshold on a cubic spline through the converged grid points, between xa and xb
+   static double SplineCrossing(const std::vector<Point>& grid, double threshold, double xa, double xb)
+   {
+      std::vector<double> x, y;
+      for (const auto& p : grid) {
+         if (p.status > 1) continue;
+         x.push_back(p.x);
+         y.push_back(p.deltaNLL);
+      }
+      if (x.size() < 3) return 0.5 * (xa + xb);
+      TSpline3 spline("profile_spline", x.data(), y.data(), x.size());
+
+      double lo = std::min(xa, xb), hi = std::max(xa, xb);
+      const bool rising = spline.Eval(hi) > spline.Eval(lo);
+      for (int i = 0; i < 50; ++i) {
+         const double mid = 0.5 * (lo + hi);
+         if ((spline.Eval(mid) < threshold) == rising) lo = mid;
+         else hi = mid;
+      }
+      return 0.5 * (lo + hi);
+   }
+
+   std::string fPOIName;
+   FitWorkers fWorkers;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef HYPOTHESIS_TEST_RESULT_WRITER_H
+#define HYPOTHESIS_TEST_RESULT_WRITER_H
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TMath.h"
+#include "TTree.h"
+#include "Math/ProbFuncMathCore.h"
+#include "RooFitResult.h"
+#include "RooStats/HypoTestInverterResult.h"
+#include "RooStats/HypoTestResult.h"
+#include "RooStats/SamplingDistribution.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// Writes the results of the hypothesis tests to flat TTrees, one row per
+// entry, so that the outputs of many jobs can be merged with hadd and
+// aggregated column by column (e.g. with RDataFrame) instead of parsing logs.
+// Every row carries the job tag and a label naming the calculator. The job
+// tag must differ between the jobs of a batch (a job id, or by default the
+// name of the output file) so that their rows can be told apart after hadd.
+//
+//   scan      : one row per point of a HypoTestInverter scan
+//   limits    : observed and expected limits
+//   tests     : p-values and significance of a hypothesis test
+//   intervals : profile likelihood intervals
+//   curves    : points of a profile likelihood curve
+//   fits      : status of a fit
+//   toys      : number of toys and of toys skipped because a fit failed
+//
+// Expected values are stored as arrays of 5 entries for -2,-1,0,+1,+2 sigma.
+//////////////////////////////////////////////////////////////////////////////
+
+class ResultWriter {
+public:
+   ResultWriter(const char* fileName, const char* job = "")
+      : fJob(job && job[0] ? job : fileName)
+   {
+      TDirectory::TContext context;  // the trees are created in the file, then the current directory is restored
+      fFile.reset(TFile::Open(fileName, "RECREATE"));
+      if (!fFile) return;
+      fFile->cd();
+
+      fScan = NewTree("scan", "HypoTestInverter scan points");
+      fScan->Branch("poi", &fPOI);
+      fScan->Branch("cls", &fCLs);
+      fScan->Branch("clsError", &fCLsError);
+      fScan->Branch("clb", &fCLb);
+      fScan->Branch("clbError", &fCLbError);
+      fScan->Branch("clsb", &fCLsb);
+      fScan->Branch("clsbError", &fCLsbError);
+      fScan->Branch("expectedCLs", fExpectedCLs, "expectedCLs[5]/D");
+
+      fLimits = NewTree("limits", "Observed and expected limits");
+      fLimits->Branch("cl", &fCL);
+      fLimits->Branch("upperLimit", &fUpper);
+      fLimits->Branch("upperLimitError", &fUpperError);
+      fLimits->Branch("lowerLimit", &fLower);
+      fLimits->Branch("lowerLimitError", &fLowerError);
+      fLimits->Branch("expectedUpperLimit", fExpectedLimits, "expectedUpperLimit[5]/D");
+
+      fTests = NewTree("tests", "Hypothesis test results");
+      fTests->Branch("nullPValue", &fNullPValue);
+      fTests->Branch("nullPValueError", &fNullPValueError);
+      fTests->Branch("altPValue", &fAltPValue);
+      fTests->Branch("altPValueError", &fAltPValueError);
+      fTests->Branch("cls", &fTestCLs);
+      fTests->Branch("clsError", &fTestCLsError);
+      fTests->Branch("significance", &fSignificance);
+      fTests->Branch("testStatistic", &fTestStatistic);
+
+      fIntervals = NewTree("intervals", "Profile likelihood intervals");
+      fIntervals->Branch("cl", &fIntervalCL);
+      fIntervals->Branch("mle", &fMLE);
+      fIntervals->Branch("lowerLimit", &fIntervalLower);
+      fIntervals->Branch("upperLimit", &fIntervalUpper);
+
+      fCurves = NewTree("curves", "Profile likelihood curves");
+      fCurves->Branch("poi", &fCurvePOI);
+      fCurves->Branch("deltaNLL", &fDeltaNLL);
+      fCurves->Branch("status", &fCurveStatus);
+
+      fFits = NewTree("fits", "Fit status");
+      fFits->Branch("status", &fFitStatus);
+      fFits->Branch("covQual", &fCovQual);
+      fFits->Branch("minNll", &fMinNll);
+      fFits->Branch("edm", &fEdm);
+
+      fToys = NewTree("toys", "Toys and toys skipped because a fit failed");
+      fToys->Branch("nToys", &fNToys);
+      fToys->Branch("nSkipped", &fNSkipped);
+   }
+
+   ~ResultWriter() { Close(); }
+
+   bool IsOpen() const { return fFile != nullptr; }
+
+   // Every point of the scan with CLs, CLb, CLs+b, their errors and the expected CLs band
+   void WriteScan(const char* label, RooStats::HypoTestInverterResult& result)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      for (int i = 0; i < result.ArraySize(); ++i) {
+         fPOI = result.GetXValue(i);
+         fCLs = result.CLs(i);
+         fCLsError = result.CLsError(i);
+         fCLb = result.CLb(i);
+         fCLbError = result.CLbError(i);
+         fCLsb = result.CLsplusb(i);
+         fCLsbError = result.CLsplusbError(i);
+         ExpectedBand(result, i);
+         fScan->Fill();
+      }
+   }
+
+   void WriteLimits(const char* label, RooStats::HypoTestInverterResult& result)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fCL = result.ConfidenceLevel();
+      fUpper = result.UpperLimit();
+      fUpperError = result.UpperLimitEstimatedError();
+      fLower = result.LowerLimit();
+      fLowerError = result.LowerLimitEstimatedError();
+      for (int k = 0; k < 5; ++k) fExpectedLimits[k] = result.GetExpectedUpperLimit(k - 2);
+      fLimits->Fill();
+   }
+
+   void WriteHypoTest(const char* label, const RooStats::HypoTestResult& result)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fNullPValue = result.NullPValue();
+      fNullPValueError = result.NullPValueError();
+      fAltPValue = result.AlternatePValue();
+      fAltPValueError = result.AlternatePValueError();
+      fTestCLs = result.CLs();
+      fTestCLsError = result.CLsError();
+      fSignificance = result.Significance();
+      fTestStatistic = result.GetTestStatisticData();
+      fTests->Fill();
+   }
+
+   void WriteInterval(const char* label, double cl, double mle, double lower, double upper)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fIntervalCL = cl;
+      fMLE = mle;
+      fIntervalLower = lower;
+      fIntervalUpper = upper;
+      fIntervals->Fill();
+   }
+
+   void WriteCurvePoint(const char* label, double poi, double deltaNLL, int status)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fCurvePOI = poi;
+      fDeltaNLL = deltaNLL;
+      fCurveStatus = status;
+      fCurves->Fill();
+   }
+
+   void WriteFit(const char* label, const RooFitResult& fit)
+   {
+      WriteFit(label, fit.status(), fit.minNll(), fit.covQual(), fit.edm());
+   }
+
+   // For fits that do not produce a RooFitResult (ProfileScan, ContourScan); -1 if not known
+   void WriteFit(const char* label, int status, double minNll, int covQual = -1, double edm = -1)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fFitStatus = status;
+      fCovQual = covQual;
+      fMinNll = minNll;
+      fEdm = edm;
+      fFits->Fill();
+   }
+
+   void WriteToys(const char* label, int nToys, int nSkipped)
+   {
+      if (!fFile) return;
+      fLabel = label;
+      fNToys = nToys;
+      fNSkipped = nSkipped;
+      fToys->Fill();
+   }
+
+   void Close()
+   {
+      if (!fFile) return;
+      fFile->Write();
+      fFile->Close();
+      fFile.reset();
+   }
+
+private:
+   // Range of the asymptotic expected CLs grid, HypoTestInverterResult::fgAsymptoticMaxSigma (not public)
+   static constexpr double kAsymptoticMaxSigma = 5;
+
+   ResultWriter(const ResultWriter&) = delete;
+   ResultWriter& operator=(const ResultWriter&) = delete;
+
+   // Trees are owned by the file
+   TTree* NewTree(const char* name, const char* title)
+   {
+      TTree* tree = new TTree(name, title);
+      tree->Branch("job", &fJob);
+      tree->Branch("label", &fLabel);
+      return tree;
+   }
+
+   // Expected CLs at -2..+2 sigma, as in HypoTestInverterPlot::MakeExpectedPlot.
+   // For toys the values are samples of the CLs distribution and the band is given by its quantiles.
+   // For the asymptotic calculator (no test statistic distributions) they are the expected CLs on an
+   // equidistant grid of n sigma from -kAsymptoticMaxSigma to +kAsymptoticMaxSigma, which is indexed
+   // directly.
+   void ExpectedBand(RooStats::HypoTestInverterResult& result, int i)
+   {
+      std::unique_ptr<RooStats::SamplingDistribution> dist(result.GetExpectedPValueDist(i));
+      std::vector<double> values;
+      if (dist) values = dist->GetSamplingDistribution();
+      if (values.empty()) {
+         std::fill(fExpectedCLs, fExpectedCLs + 5, -1.);
+         return;
+      }
+      const bool asymptotic = !result.GetNullTestStatDist(i) && !result.GetAltTestStatDist(i);
+      if (asymptotic) {
+         const double dsig = values.size() > 1 ? 2 * kAsymptoticMaxSigma / (values.size() - 1) : 1;
+         for (int k = 0; k < 5; ++k) {
+            const int index = (int)std::floor((k - 2 + kAsymptoticMaxSigma) / dsig + 0.5);
+            fExpectedCLs[k] = values[std::min(std::max(index, 0), (int)values.size() - 1)];
+         }
+         return;
+      }
+      std::sort(values.begin(), values.end());
+      double prob[5];
+      for (int k = 0; k < 5; ++k) prob[k] = ROOT::Math::normal_cdf(k - 2);
+      TMath::Quantiles(values.size(), values.data(), 5, fExpectedCLs, prob, true);
+   }
+
+   std::unique_ptr<TFile> fFile;
+   TTree* fScan = 0;
+   TTree* fLimits = 0;
+   TTree* fTests = 0;
+   TTree* fIntervals = 0;
+   TTree* fCurves = 0;
+   TTree* fFits = 0;
+   TTree* fToys = 0;
+
+   // branch buffers: job and label are shared by all trees, every other column has its own
+   std::string fJob;
+   std::string fLabel;
+   // scan
+   double fPOI = 0, fCLs = 0, fCLsError = 0, fCLb = 0, fCLbError = 0, fCLsb = 0, fCLsbError = 0;
+   double fExpectedCLs[5] = {0, 0, 0, 0, 0};
+   // limits
+   double fCL = 0, fUpper = 0, fUpperError = 0, fLower = 0, fLowerError = 0;
+   double fExpectedLimits[5] = {0, 0, 0, 0, 0};
+   // tests
+   double fNullPValue = 0, fNullPValueError = 0, fAltPValue = 0, fAltPValueError = 0;
+   double fTestCLs = 0, fTestCLsError = 0, fSignificance = 0, fTestStatistic = 0;
+   // intervals
+   double fIntervalCL = 0, fMLE = 0, fIntervalLower = 0, fIntervalUpper = 0;
+   // curves
+   double fCurvePOI = 0, fDeltaNLL = 0;
+   int fCurveStatus = 0;
+   // fits
+   int fFitStatus = 0, fCovQual = 0;
+   double fMinNll = 0, fEdm = 0;
+   // toys
+   int fNToys = 0, fNSkipped = 0;
+};
+
+#endif
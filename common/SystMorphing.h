@@ -0,0 +1,314 @@
+#ifndef HYPOTHESIS_TEST_SYST_MORPHING_H
+#define HYPOTHESIS_TEST_SYST_MORPHING_H
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "RooAbsReal.h"
+#include "RooAbsRealLValue.h"
+#include "RooArgList.h"
+#include "RooDataHist.h"
+#include "RooListProxy.h"
+#include "RooMsgService.h"
+#include "RooRealProxy.h"
+#include "RooRealVar.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// Template morphing for shape systematics.
+//
+// Each nuisance parameter alpha_k comes with an up (alpha=+1) and a down
+// (alpha=-1) variation of a nominal template. The per-bin interpolation
+// coefficients are computed once, when the variation is added, and stored
+// contiguously as [nuisance][bin]. Evaluating the morphed template for a new
+// set of alphas is then one pass of multiply-adds over those arrays, so the
+// cost of a NLL call grows with nbins*nnuisances instead of re-interpolating
+// every bin of every template on each call.
+//
+// Both interpolation modes use the smooth 6th order polynomial of HistFactory
+// (interpolation code 4) inside |alpha|<1 and a linear extrapolation outside:
+//   - kPolynomial  : additive shift of the bin content
+//   - kExponential : the same polynomial applied to log(variation/nominal),
+//                    which keeps the bin content positive
+//////////////////////////////////////////////////////////////////////////////
+
+class HistMorphing {
+public:
+   enum Interpolation { kPolynomial, kExponential };
+
+   HistMorphing() {}
+   explicit HistMorphing(const std::vector<double>& nominal) : fNominal(nominal) {}
+
+   int NBins() const { return fNominal.size(); }
+   int NNuisances() const { return fMode.size(); }
+   const std::vector<double>& Nominal() const { return fNominal; }
+
+   // Precompute the coefficients of one nuisance parameter.
+   // With d+ = f(up) - f(nom) and d- = f(nom) - f(down), where f is the
+   // identity (polynomial) or log (exponential), the shift of a bin is
+   //    delta(alpha) = u(alpha) * S + v(alpha) * A ,  S = (d+ + d-)/2 , A = (d+ - d-)/2
+   // so only S and A have to be stored for every bin. up and down must have the bins of the nominal.
+   void AddVariation(const std::vector<double>& up, const std::vector<double>& down, Interpolation mode)
+   {
+      const int nbins = NBins();
+      if ((int)up.size() != nbins || (int)down.size() != nbins) {
+         throw std::invalid_argument("HistMorphing: " + std::to_string(up.size()) + " up and " +
+                                     std::to_string(down.size()) + " down bins for a nominal template of " +
+                                     std::to_string(nbins) + " bins");
+      }
+      std::vector<double>& sym  = (mode == kPolynomial) ? fAddSym  : fLogSym;
+      std::vector<double>& asym = (mode == kPolynomial) ? fAddAsym : fLogAsym;
+
+      for (int i = 0; i < nbins; ++i) {
+         double dup, ddown;
+         if (mode == kPolynomial) {
+            dup   = up[i] - fNominal[i];
+            ddown = fNominal[i] - down[i];
+         } else {
+            // empty bins cannot be morphed multiplicatively, leave them at nominal
+            const bool valid = fNominal[i] > 0 && up[i] > 0 && down[i] > 0;
+            dup   = valid ? std::log(up[i] / fNominal[i]) : 0;
+            ddown = valid ? -std::log(down[i] / fNominal[i]) : 0;
+         }
+         sym.push_back(0.5 * (dup + ddown));
+         asym.push_back(0.5 * (dup - ddown));
+      }
+      fMode.push_back(mode);
+   }
+
+   // Evaluate all bins for all nuisances. alphas must be given in the order
+   // the variations were added. The result is written to out[0..nbins).
+   void Evaluate(const double* alphas, double* out) const
+   {
+      const int nbins = NBins();
+      const int nnuis = NNuisances();
+
+      fLogShift.assign(nbins, 0.);   // reuses the capacity of the previous call
+      for (int i = 0; i < nbins; ++i) out[i] = fNominal[i];
+
+      int iadd = 0, ilog = 0;
+      for (int k = 0; k < nnuis; ++k) {
+         double u, v;
+         Coefficients(alphas[k], u, v);
+
+         // contiguous arrays with no branching inside: the compiler vectorises these loops
+         if (fMode[k] == kPolynomial) {
+            const double* s = &fAddSym[iadd * nbins];
+            const double* a = &fAddAsym[iadd * nbins];
+            for (int i = 0; i < nbins; ++i) out[i] += u * s[i] + v * a[i];
+            ++iadd;
+         } else {
+            const double* s = &fLogSym[ilog * nbins];
+            const double* a = &fLogAsym[ilog * nbins];
+            double* l = fLogShift.data();
+            for (int i = 0; i < nbins; ++i) l[i] += u * s[i] + v * a[i];
+            ++ilog;
+         }
+      }
+
+      if (ilog > 0) {
+         for (int i = 0; i < nbins; ++i) out[i] *= std::exp(fLogShift[i]);
+      }
+      // a negative expectation makes the likelihood undefined
+      for (int i = 0; i < nbins; ++i) out[i] = std::max(out[i], 0.);
+   }
+
+private:
+   // The alpha dependence is the same for every bin, so it is computed once
+   // per nuisance. Inside |alpha|<1: u = alpha, v = alpha^2 (15 - 10 alpha^2 + 3 alpha^4)/8.
+   // Outside, the shift continues linearly along d+ (alpha>1) or d- (alpha<-1).
+   static void Coefficients(double alpha, double& u, double& v)
+   {
+      u = alpha;
+      if (alpha > 1) {
+         v = alpha;
+      } else if (alpha < -1) {
+         v = -alpha;
+      } else {
+         const double a2 = alpha * alpha;
+         v = a2 * (15 - 10 * a2 + 3 * a2 * a2) / 8;
+      }
+   }
+
+   std::vector<double> fNominal;
+   std::vector<int> fMode;
+   std::vector<double> fAddSym, fAddAsym;   // [polynomial nuisance][bin]
+   std::vector<double> fLogSym, fLogAsym;   // [exponential nuisance][bin]
+   mutable std::vector<double> fLogShift;   //! scratch buffer of Evaluate
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The morphed template as a RooFit node. Its servers are the alphas, so
+// RooFit marks it dirty only when one of them changes and it is recomputed
+// at most once per NLL evaluation. Its value is the sum of the morphed bin
+// contents; the contents themselves are read with Contents().
+//////////////////////////////////////////////////////////////////////////////
+
+class MorphedTemplate : public RooAbsReal {
+public:
+   MorphedTemplate() {}
+
+   MorphedTemplate(const char* name, const char* title, const RooDataHist& nominal)
+      : RooAbsReal(name, title), _alphas("alphas", "nuisance parameters", this), _morph(BinContents(nominal))
+   {
+   }
+
+   MorphedTemplate(const MorphedTemplate& other, const char* name = 0)
+      : RooAbsReal(other, name), _alphas("alphas", this, other._alphas), _morph(other._morph)
+   {
+   }
+
+   TObject* clone(const char* newname) const override { return new MorphedTemplate(*this, newname); }
+
+   // Add a shape systematic driven by alpha (alpha=0 nominal, alpha=+-1 the up/down templates).
+   // Throws std::invalid_argument if the templates do not have the bins of the nominal one.
+   void AddShapeSys(RooAbsReal& alpha, const RooDataHist& up, const RooDataHist& down,
+                    HistMorphing::Interpolation mode = HistMorphing::kExponential)
+   {
+      _morph.AddVariation(BinContents(up), BinContents(down), mode);
+      _alphas.add(alpha);
+      _contents.clear();
+      setValueDirty();
+   }
+
+   int NBins() const { return _morph.NBins(); }
+
+   // Morphed bin contents at the current alphas. getVal() only calls evaluate() when an
+   // alpha has changed, so calling this once per bin costs one dirty-flag check.
+   const std::vector<double>& Contents() const
+   {
+      getVal();
+      // a clean value with an empty cache: the object was just read or cloned
+      if (_contents.empty()) Recompute();
+      return _contents;
+   }
+
+   static std::vector<double> BinContents(const RooDataHist& hist)
+   {
+      std::vector<double> contents(hist.numEntries());
+      for (int i = 0; i < hist.numEntries(); ++i) {
+         hist.get(i);
+         contents[i] = hist.weight();
+      }
+      return contents;
+   }
+
+protected:
+   Double_t evaluate() const override
+   {
+      Recompute();
+      double sum = 0;
+      for (double c : _contents) sum += c;
+      return sum;
+   }
+
+private:
+   void Recompute() const
+   {
+      const int nnuis = _alphas.getSize();
+      _alphaValues.resize(nnuis);
+      for (int k = 0; k < nnuis; ++k) _alphaValues[k] = static_cast<RooAbsReal&>(_alphas[k]).getVal();
+      _contents.resize(_morph.NBins());
+      _morph.Evaluate(_alphaValues.data(), _contents.data());
+   }
+
+   RooListProxy _alphas;
+   HistMorphing _morph;
+
+   mutable std::vector<double> _alphaValues;   //! scratch buffer for the alphas
+   mutable std::vector<double> _contents;      //! morphed template
+
+   ClassDefOverride(MorphedTemplate, 1)
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Drop-in replacement for RooHistFunc with shape systematics. It returns the
+// morphed content of the bin containing x, exactly like HistFunc::sig(x,template)
+// returns the template content, so it can be used in the same ASUM model.
+// The morphing is done by a MorphedTemplate server, which RooFit recomputes
+// only after an alpha has changed; evaluating a bin reads its cached contents.
+//////////////////////////////////////////////////////////////////////////////
+
+class MorphedHistFunc : public RooAbsReal {
+public:
+   MorphedHistFunc() {}
+
+   // Throws std::invalid_argument if x does not have the bins of the template
+   MorphedHistFunc(const char* name, const char* title, RooRealVar& x, MorphedTemplate& morphed)
+      : RooAbsReal(name, title), _x("x", "observable", this, x), _template("template", "morphed template", this, morphed)
+   {
+      // evaluate() and the integral index the template with the bins of x
+      const RooAbsBinning& binning = x.getBinning();
+      if (binning.numBins() != morphed.NBins()) {
+         coutE(InputArguments) << "MorphedHistFunc::" << GetName() << " binning of " << x.GetName()
+                               << " does not match the template " << morphed.GetName() << std::endl;
+         throw std::invalid_argument(std::string("MorphedHistFunc::") + GetName() + ": " +
+                                     std::to_string(binning.numBins()) + " bins in " + x.GetName() + ", " +
+                                     std::to_string(morphed.NBins()) + " in " + morphed.GetName());
+      }
+      for (int i = 0; i < binning.numBins(); ++i) _edges.push_back(binning.binLow(i));
+      _edges.push_back(binning.highBound());
+   }
+
+   MorphedHistFunc(const MorphedHistFunc& other, const char* name = 0)
+      : RooAbsReal(other, name), _x("x", this, other._x), _template("template", this, other._template), _edges(other._edges)
+   {
+   }
+
+   TObject* clone(const char* newname) const override { return new MorphedHistFunc(*this, newname); }
+
+   // Analytical integral over x, needed by ASUM (RooRealSumPdf) for the normalisation
+   Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* /*rangeName*/ = 0) const override
+   {
+      return matchArgs(allVars, analVars, _x) ? 1 : 0;
+   }
+
+   Double_t analyticalIntegral(Int_t code, const char* rangeName = 0) const override
+   {
+      if (code != 1) return 0;
+      const std::vector<double>& contents = Morphed();
+      const double xlo = _x.min(rangeName), xhi = _x.max(rangeName);
+
+      double sum = 0;
+      for (int i = 0; i < (int)contents.size(); ++i) {
+         const double lo = std::max(xlo, _edges[i]), hi = std::min(xhi, _edges[i + 1]);
+         if (hi > lo) sum += contents[i] * (hi - lo);
+      }
+      return sum;
+   }
+
+   Bool_t isBinnedDistribution(const RooArgSet& /*obs*/) const override { return true; }
+
+   std::list<Double_t>* binBoundaries(RooAbsRealLValue& obs, Double_t xlo, Double_t xhi) const override
+   {
+      if (std::string(obs.GetName()) != _x.arg().GetName()) return 0;
+      std::list<Double_t>* boundaries = new std::list<Double_t>;
+      for (double edge : _edges) {
+         if (edge >= xlo && edge <= xhi) boundaries->push_back(edge);
+      }
+      return boundaries;
+   }
+
+protected:
+   Double_t evaluate() const override
+   {
+      const double x = _x;
+      if (x < _edges.front() || x >= _edges.back()) return 0;
+      const int bin = std::upper_bound(_edges.begin(), _edges.end(), x) - _edges.begin() - 1;
+      return Morphed()[bin];
+   }
+
+private:
+   const std::vector<double>& Morphed() const { return static_cast<const MorphedTemplate&>(_template.arg()).Contents(); }
+
+   RooRealProxy _x;
+   RooRealProxy _template;
+   std::vector<double> _edges;
+
+   ClassDefOverride(MorphedHistFunc, 2)
+};
+
+#endif
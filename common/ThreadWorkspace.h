@@ -0,0 +1,300 @@
+#ifndef HYPOTHESIS_TEST_THREAD_WORKSPACE_H
+#define HYPOTHESIS_TEST_THREAD_WORKSPACE_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "TROOT.h"
+#include "Math/Factory.h"
+#include "Math/Functor.h"
+#include "Math/Minimizer.h"
+#include "Math/MinimizerOptions.h"
+#include "RooAbsData.h"
+#include "RooAbsPdf.h"
+#include "RooAbsReal.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooGlobalFunc.h"
+#include "RooRealVar.h"
+#include "RooWorkspace.h"
+#include "RooStats/ModelConfig.h"
+
+#include "WorkStealingPool.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// RooFit objects must not be shared between threads, so every worker thread
+// fits its own deep copy of the workspace. The copies are made in the calling
+// thread before the workers start (FitWorkers). While workers are running:
+//   - every RooFit object created or deleted in any thread (NLL, data clones,
+//     toy datasets, minimizers) is created or deleted holding
+//     ConstructionMutex()
+//   - so is the first evaluation of a new NLL: it computes the integrals of
+//     the normalisation set and fills RooFit's caches, the RooArgSet memory
+//     pool and the name registry, which are shared (SetData)
+//   - RooFit's process-wide eval error log is switched off with an
+//     EvalErrorGuard, because the NLL of every worker would write to it
+//   - the fits do not use RooMinimizer, which turns that log on and off
+//     around every minimisation, but drive Minuit2 directly (Minimize)
+// The minimisations themselves run concurrently.
+//////////////////////////////////////////////////////////////////////////////
+
+typedef std::vector<std::pair<std::string, double>> ParameterValues;
+
+// Switches the eval error log of RooAbsReal off for its lifetime and restores the previous mode.
+// To be created in the calling thread before tasks are submitted and destroyed after they have all
+// finished; the calling thread must not run RooMinimizer fits in between.
+class EvalErrorGuard {
+public:
+   EvalErrorGuard() : fMode(RooAbsReal::evalErrorLoggingMode())
+   {
+      RooAbsReal::setEvalErrorLoggingMode(RooAbsReal::Ignore);
+   }
+   ~EvalErrorGuard() { RooAbsReal::setEvalErrorLoggingMode(fMode); }
+
+private:
+   EvalErrorGuard(const EvalErrorGuard&) = delete;
+   EvalErrorGuard& operator=(const EvalErrorGuard&) = delete;
+
+   RooAbsReal::ErrorLoggingMode fMode;
+};
+
+class ThreadWorkspace {
+public:
+   // w is copied; pdfName is the model to fit, observables are used to find its parameters and
+   // constrainedParams are the nuisance parameters with constraint terms (may be 0)
+   ThreadWorkspace(const RooWorkspace& w, const char* pdfName, const RooArgSet& observables,
+                   const RooArgSet* constrainedParams = 0)
+      : fWorkspace(new RooWorkspace(w))
+   {
+      fPdf = fWorkspace->pdf(pdfName);
+      std::unique_ptr<RooArgSet> params(fPdf->getParameters(observables));
+      fParams.add(*params);
+      if (constrainedParams) {
+         for (int i = 0; i < constrainedParams->getSize(); ++i) {
+            RooAbsArg* p = fParams.find((*constrainedParams)[i].GetName());
+            if (p) fConstrained.add(*p);
+         }
+      }
+   }
+
+   ~ThreadWorkspace()
+   {
+      std::lock_guard<std::mutex> lock(ConstructionMutex());
+      fNLL.reset();
+      fData.reset();
+      fWorkspace.reset();
+   }
+
+   // One copy per worker thread, to be called from the main thread
+   static std::vector<std::unique_ptr<ThreadWorkspace>> MakeCopies(const RooWorkspace& w, const char* pdfName,
+                                                                   const RooArgSet& observables,
+                                                                   const RooArgSet* constrainedParams, int n)
+   {
+      ROOT::EnableThreadSafety();
+      std::vector<std::unique_ptr<ThreadWorkspace>> copies;
+      for (int i = 0; i < n; ++i) {
+         copies.emplace_back(new ThreadWorkspace(w, pdfName, observables, constrainedParams));
+      }
+      return copies;
+   }
+
+   static std::mutex& ConstructionMutex()
+   {
+      static std::mutex m;
+      return m;
+   }
+
+   RooWorkspace& Workspace() { return *fWorkspace; }
+   RooAbsPdf& Pdf() { return *fPdf; }
+   RooRealVar* Var(const std::string& name) { return dynamic_cast<RooRealVar*>(fParams.find(name.c_str())); }
+
+   // Build the NLL of this copy for the given data. The data may belong to another
+   // thread, so it is cloned first; RooFit binds the observables by name. The
+   // NLL is evaluated once under the lock, since its first evaluation with a new
+   // normalisation set creates the integrals and fills the shared caches; later
+   // evaluations (Minimize) only read them.
+   RooAbsReal& SetData(const RooAbsData& data)
+   {
+      std::lock_guard<std::mutex> lock(ConstructionMutex());
+      fNLL.reset();
+      fData.reset(static_cast<RooAbsData*>(data.Clone()));
+      fNLL.reset(fPdf->createNLL(*fData, RooFit::Constrain(fConstrained)));
+      fNLL->getVal();
+      return *fNLL;
+   }
+
+   RooAbsReal& NLL() { return *fNLL; }
+
+   // Set parameters by name, parameters not in this copy are ignored
+   void SetValues(const ParameterValues& values)
+   {
+      for (const auto& v : values) {
+         RooRealVar* var = Var(v.first);
+         if (var) var->setVal(v.second);
+      }
+   }
+
+   // Values of all parameters, in a fixed order, to warm start a later fit
+   std::vector<double> GetValues() const
+   {
+      std::vector<double> values(fParams.getSize());
+      for (int i = 0; i < fParams.getSize(); ++i) values[i] = static_cast<RooAbsReal&>(fParams[i]).getVal();
+      return values;
+   }
+
+   void SetValues(const std::vector<double>& values)
+   {
+      for (int i = 0; i < fParams.getSize(); ++i) {
+         RooRealVar* var = dynamic_cast<RooRealVar*>(&fParams[i]);
+         if (var) var->setVal(values[i]);
+      }
+   }
+
+   // Minimise the NLL over the floating parameters, starting from their current values, and leave
+   // them at the minimum with the Migrad errors. Returns the minimum NLL; status is the Minuit2
+   // status (0 ok, 1 covariance made positive definite, >1 failed).
+   // Minuit2 is used because TMinuit is not thread safe. Since the eval error log is off in the
+   // workers, a NLL that is not finite is replaced by a wall above the largest value seen, like
+   // RooMinimizer does for evaluation errors.
+   double Minimize(int& status)
+   {
+      std::vector<RooRealVar*> floating;
+      for (RooAbsArg* arg : fParams) {
+         RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+         if (var && !var->isConstant()) floating.push_back(var);
+      }
+      status = 0;
+      if (floating.empty()) return fNLL->getVal();
+
+      double maxNLL = -std::numeric_limits<double>::infinity();
+      auto nll = [&](const double* x) {
+         for (size_t i = 0; i < floating.size(); ++i) floating[i]->setVal(x[i]);
+         const double value = fNLL->getVal();
+         if (std::isfinite(value)) {
+            maxNLL = std::max(maxNLL, value);
+            return value;
+         }
+         return std::isfinite(maxNLL) ? maxNLL + 10 : 1e30;
+      };
+      ROOT::Math::Functor fcn(nll, floating.size());
+
+      std::unique_ptr<ROOT::Math::Minimizer> minim;
+      {
+         std::lock_guard<std::mutex> lock(ConstructionMutex());
+         minim.reset(ROOT::Math::Factory::CreateMinimizer("Minuit2", "Migrad"));
+      }
+      minim->SetFunction(fcn);
+      minim->SetPrintLevel(-1);
+      minim->SetStrategy(ROOT::Math::MinimizerOptions::DefaultStrategy());
+      minim->SetErrorDef(0.5);
+      for (size_t i = 0; i < floating.size(); ++i) {
+         const RooRealVar& var = *floating[i];
+         const double range = var.hasMin() && var.hasMax() ? var.getMax() - var.getMin() : 0;
+         double step = var.getError();
+         if (step <= 0) step = range > 0 ? 0.1 * range : 0.1 * std::max(std::fabs(var.getVal()), 1.);
+         if (var.hasMin() && var.hasMax()) {
+            minim->SetLimitedVariable(i, var.GetName(), var.getVal(), step, var.getMin(), var.getMax());
+         } else if (var.hasMin()) {
+            minim->SetLowerLimitedVariable(i, var.GetName(), var.getVal(), step, var.getMin());
+         } else if (var.hasMax()) {
+            minim->SetUpperLimitedVariable(i, var.GetName(), var.getVal(), step, var.getMax());
+         } else {
+            minim->SetVariable(i, var.GetName(), var.getVal(), step);
+         }
+      }
+
+      minim->Minimize();
+      status = minim->Status();
+      for (size_t i = 0; i < floating.size(); ++i) {
+         floating[i]->setVal(minim->X()[i]);
+         if (minim->Errors()) floating[i]->setError(minim->Errors()[i]);
+      }
+      {
+         std::lock_guard<std::mutex> lock(ConstructionMutex());
+         minim.reset();
+      }
+      return fNLL->getVal();
+   }
+
+   // Profiled NLL with the given parameters fixed at the given values, starting from the current
+   // values of the others. The fixed parameters float again afterwards.
+   double FitFixed(const ParameterValues& fixed, int& status)
+   {
+      for (const auto& p : fixed) {
+         RooRealVar* var = Var(p.first);
+         if (!var) continue;
+         var->setVal(p.second);
+         var->setConstant(true);
+      }
+      const double nll = Minimize(status);
+      for (const auto& p : fixed) {
+         RooRealVar* var = Var(p.first);
+         if (var) var->setConstant(false);
+      }
+      return nll;
+   }
+
+   // Unconditional fit: the given parameters are made floating first
+   double FitFree(const std::vector<std::string>& names, int& status)
+   {
+      for (const std::string& name : names) {
+         RooRealVar* var = Var(name);
+         if (var) var->setConstant(false);
+      }
+      return Minimize(status);
+   }
+
+private:
+   std::unique_ptr<RooWorkspace> fWorkspace;
+   RooAbsPdf* fPdf = 0;
+   RooArgList fParams;
+   RooArgSet fConstrained;
+   std::unique_ptr<RooAbsData> fData;
+   std::unique_ptr<RooAbsReal> fNLL;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The workspace copies of a set of worker threads and the pool that runs
+// them. A task submitted to Pool() receives the index of the copy it owns.
+// Between tasks, once Pool().Wait() has returned, the copies may also be
+// used from the calling thread.
+//////////////////////////////////////////////////////////////////////////////
+
+class FitWorkers {
+public:
+   // pdfName, observables and constrainedParams as for ThreadWorkspace; nThreads <= 0 is one per core
+   FitWorkers(const RooWorkspace& w, const char* pdfName, const RooArgSet& observables,
+              const RooArgSet* constrainedParams, int nThreads)
+   {
+      const int n = nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency());
+      fCopies = ThreadWorkspace::MakeCopies(w, pdfName, observables, constrainedParams, n);
+      fPool.reset(new WorkStealingPool(n));
+   }
+
+   // Copies of the pdf of mc, each with its NLL for data
+   FitWorkers(const RooWorkspace& w, const RooStats::ModelConfig& mc, const RooAbsData& data, int nThreads)
+      : FitWorkers(w, mc.GetPdf()->GetName(), *mc.GetObservables(), mc.GetNuisanceParameters(), nThreads)
+   {
+      for (auto& copy : fCopies) copy->SetData(data);
+   }
+
+   int Size() const { return fCopies.size(); }
+   ThreadWorkspace& operator[](int worker) { return *fCopies[worker]; }
+   WorkStealingPool& Pool() { return *fPool; }
+
+private:
+   FitWorkers(const FitWorkers&) = delete;
+   FitWorkers& operator=(const FitWorkers&) = delete;
+
+   std::vector<std::unique_ptr<ThreadWorkspace>> fCopies;
+   std::unique_ptr<WorkStealingPool> fPool;   // declared last: joined before the copies are deleted
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef HYPOTHESIS_TEST_WORK_STEALING_POOL_H
+#define HYPOTHESIS_TEST_WORK_STEALING_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// Minimal work-stealing thread pool. Every worker owns a deque of tasks: it
+// takes tasks from the front of its own deque and, when that is empty, steals
+// from the back of the other workers' deques. A task receives the index of the
+// worker running it, so that it can use per-worker state such as the
+// workspace copies of ThreadWorkspace.
+//////////////////////////////////////////////////////////////////////////////
+
+class WorkStealingPool {
+public:
+   typedef std::function<void(int)> Task;
+
+   explicit WorkStealingPool(int nWorkers)
+   {
+      for (int i = 0; i < nWorkers; ++i) fQueues.emplace_back(new Queue);
+      for (int i = 0; i < nWorkers; ++i) fThreads.emplace_back(&WorkStealingPool::Run, this, i);
+   }
+
+   ~WorkStealingPool()
+   {
+      Wait();
+      {
+         std::lock_guard<std::mutex> lock(fMutex);
+         fStop = true;
+      }
+      fWake.notify_all();
+      for (auto& t : fThreads) t.join();
+   }
+
+   int NWorkers() const { return fQueues.size(); }
+
+   // Queue a task, preferably for the given worker
+   void Submit(Task task, int worker)
+   {
+      Queue& q = *fQueues[worker % NWorkers()];
+      {
+         std::lock_guard<std::mutex> lock(fMutex);
+         ++fQueued;
+         ++fPending;
+      }
+      {
+         std::lock_guard<std::mutex> lock(q.mutex);
+         q.tasks.push_back(std::move(task));
+      }
+      fWake.notify_one();
+   }
+
+   // Block until all submitted tasks have finished
+   void Wait()
+   {
+      std::unique_lock<std::mutex> lock(fMutex);
+      fDone.wait(lock, [this] { return fPending == 0; });
+   }
+
+private:
+   struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+   };
+
+   bool TryPop(int worker, Task& task)
+   {
+      const int n = NWorkers();
+      for (int k = 0; k < n; ++k) {
+         Queue& q = *fQueues[(worker + k) % n];
+         std::lock_guard<std::mutex> lock(q.mutex);
+         if (q.tasks.empty()) continue;
+         if (k == 0) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+         } else {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+         }
+         return true;
+      }
+      return false;
+   }
+
+   void Run(int worker)
+   {
+      while (true) {
+         Task task;
+         if (TryPop(worker, task)) {
+            {
+               std::lock_guard<std::mutex> lock(fMutex);
+               --fQueued;
+            }
+            task(worker);
+            std::lock_guard<std::mutex> lock(fMutex);
+            if (--fPending == 0) fDone.notify_all();
+            continue;
+         }
+         std::unique_lock<std::mutex> lock(fMutex);
+         fWake.wait(lock, [this] { return fStop || fQueued > 0; });
+         if (fStop && fQueued == 0) return;
+      }
+   }
+
+   std::vector<std::unique_ptr<Queue>> fQueues;
+   std::vector<std::thread> fThreads;
+   std::mutex fMutex;
+   std::condition_variable fWake, fDone;
+   int fQueued = 0;   // submitted, not yet started
+   int fPending = 0;  // submitted, not yet finished
+   bool fStop = false;
+};
+
+#endif